@@ -120,6 +120,32 @@ void WrapUDP::close()
 
 /* ********************************************************** */
 
+// IGMP membership on all interfaces, so a listening pcb bound to
+// INADDR_ANY also receives datagrams sent to the group
+bool WrapUDP::joinGroup(const IPAddress group)
+{
+    ip_addr_t gaddr;
+    gaddr.addr = group;
+#if LWIP_VERSION_MAJOR == 1
+    return igmp_joingroup(IP_ADDR_ANY, &gaddr) == ERR_OK;
+#else
+    return igmp_joingroup(IP4_ADDR_ANY4, &gaddr) == ERR_OK;
+#endif
+}
+
+bool WrapUDP::leaveGroup(const IPAddress group)
+{
+    ip_addr_t gaddr;
+    gaddr.addr = group;
+#if LWIP_VERSION_MAJOR == 1
+    return igmp_leavegroup(IP_ADDR_ANY, &gaddr) == ERR_OK;
+#else
+    return igmp_leavegroup(IP4_ADDR_ANY4, &gaddr) == ERR_OK;
+#endif
+}
+
+/* ********************************************************** */
+
 size_t WrapUDP::writeTo(pbuf *p, ip_addr_t *addr, uint16_t port)
 {
     size_t len = 0;
@@ -47,6 +47,9 @@ public:
 
     void close();
 
+    bool joinGroup(const IPAddress group);
+    bool leaveGroup(const IPAddress group);
+
     size_t writeTo(pbuf *p, ip_addr_t *addr, uint16_t port);
     size_t writeTo(pbuf *p, const IPAddress addr, uint16_t port);
     size_t write(pbuf *p);
@@ -3,8 +3,7 @@
 #include <stdlib.h>
 #include <math.h>
 
-uint8_t brightness=8, rOffset=0, gOffset=1, bOffset=2;
-uint8_t *pixels;
+#include "adafruit.h"
 
 uint32_t ColorHSV(uint16_t hue, uint8_t sat, uint8_t val) {
     uint8_t r, g, b;
@@ -51,43 +50,67 @@ uint32_t ColorHSV(uint16_t hue, uint8_t sat, uint8_t val) {
          (((((b * s1) >> 8) + s2) * v1) >> 8);
 }
 
-void setPixelColor(uint16_t n, uint32_t c) {
-    uint8_t *p, r = (uint8_t)(c >> 16), g = (uint8_t)(c >> 8), b = (uint8_t)c;
-    if (brightness) { // See notes in setBrightness()
-        r = (r * brightness) >> 8;
-        g = (g * brightness) >> 8;
-        b = (b * brightness) >> 8;
+static PIXCTX_T defctx = { NULL, 0xffff, 8, 0, 1, 2 };
+
+// new contexts use RGB order and the current brightness
+void ctxInit(PIXCTX_T *ctx, uint8_t *pixels, uint16_t len) {
+    ctx->pixels = pixels;
+    ctx->len = len;
+    ctx->brightness = defctx.brightness;
+    ctx->rOffset = 0;
+    ctx->gOffset = 1;
+    ctx->bOffset = 2;
+}
+
+// set count pixels from first to one color, clipped to the buffer
+void ctxFillColor(PIXCTX_T *ctx, uint16_t first, uint16_t count, uint32_t c) {
+    uint8_t *p, r, g, b;
+    if (first >= ctx->len) return;
+    if (count > ctx->len - first) count = ctx->len - first;
+    c = ctxScale(ctx, c);
+    r = c >> 16; g = c >> 8; b = c;
+    p = &ctx->pixels[first * 3];
+    while (count--) {
+        p[ctx->rOffset] = r;
+        p[ctx->gOffset] = g;
+        p[ctx->bOffset] = b;
+        p += 3;
     }
-    p = &pixels[n * 3];
-    p[rOffset] = r;
-    p[gOffset] = g;
-    p[bOffset] = b;
 }
 
-void addPixelColor(uint16_t n, uint32_t c) {
-    uint8_t *p, r = (uint8_t)(c >> 16), g = (uint8_t)(c >> 8), b = (uint8_t)c;
-    if (brightness) { // See notes in setBrightness()
-        r = (r * brightness) >> 8;
-        g = (g * brightness) >> 8;
-        b = (b * brightness) >> 8;
+// copy count colors to the pixels starting at first, clipped to the buffer
+void ctxWriteColors(PIXCTX_T *ctx, uint16_t first, uint16_t count, const uint32_t *c) {
+    uint8_t *p;
+    uint32_t v;
+    if (first >= ctx->len) return;
+    if (count > ctx->len - first) count = ctx->len - first;
+    p = &ctx->pixels[first * 3];
+    while (count--) {
+        v = ctxScale(ctx, *c++);
+        p[ctx->rOffset] = v >> 16;
+        p[ctx->gOffset] = v >> 8;
+        p[ctx->bOffset] = v;
+        p += 3;
     }
-    p = &pixels[n * 3];
-    uint16_t sr = p[rOffset] + r, sg = p[gOffset] + g, sb = p[bOffset] + b;
-    p[rOffset] = sr > 255 ? 255 : sr;
-    p[gOffset] = sg > 255 ? 255 : sg;
-    p[bOffset] = sb > 255 ? 255 : sb;
+}
 
+void setPixelColor(uint16_t n, uint32_t c) {
+    ctxSetPixelColor(&defctx, n, c);
 }
 
+void addPixelColor(uint16_t n, uint32_t c) {
+    ctxAddPixelColor(&defctx, n, c);
+}
 
 // b 0..15 => 0..255
 // stored as +1 to avoid multiplication when set to max
 void setBrightness(uint8_t b) {
     float td = 4 * exp (0.277 * b);
-    brightness = (uint8_t)round(td+1);
+    defctx.brightness = (uint8_t)round(td+1);
 }
 
-uint8_t *getPixels(void) { return pixels; }
-void setPixels(uint8_t* p) { pixels = p; }
+uint8_t getBrightness(void) { return defctx.brightness; }
+uint8_t *getPixels(void) { return defctx.pixels; }
+void setPixels(uint8_t* p) { defctx.pixels = p; }
 
 // eof
@@ -1,10 +1,61 @@
 // adafruit.c provides:
 
+// render context: one pixel buffer with its length, color order and
+// brightness; contexts are independent, so several threads can draw
+// into different buffers at the same time
+typedef struct {
+    uint8_t *pixels;
+    uint16_t len;           // number of pixels, writes beyond are ignored
+    uint8_t brightness;     // stored +1, 0 = full brightness, no scaling
+    uint8_t rOffset, gOffset, bOffset;
+} PIXCTX_T;
+
 uint32_t ColorHSV(uint16_t hue, uint8_t sat, uint8_t val);
+void ctxInit(PIXCTX_T *ctx, uint8_t *pixels, uint16_t len);
+void ctxFillColor(PIXCTX_T *ctx, uint16_t first, uint16_t count, uint32_t c);
+void ctxWriteColors(PIXCTX_T *ctx, uint16_t first, uint16_t count, const uint32_t *c);
+
+// the old single buffer interface, wrappers around a default context
 void setPixelColor(uint16_t n, uint32_t c);
 void addPixelColor(uint16_t n, uint32_t c);
 uint8_t *getPixels(void);
 void setPixels(uint8_t* p);
 void setBrightness(uint8_t b);
+uint8_t getBrightness(void);
+
+static inline uint32_t ctxScale(const PIXCTX_T *ctx, uint32_t c) {
+    uint8_t r = (uint8_t)(c >> 16), g = (uint8_t)(c >> 8), b = (uint8_t)c;
+    if (ctx->brightness) { // See notes in setBrightness()
+        r = (r * ctx->brightness) >> 8;
+        g = (g * ctx->brightness) >> 8;
+        b = (b * ctx->brightness) >> 8;
+    }
+    return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+static inline void ctxSetPixelColor(PIXCTX_T *ctx, uint16_t n, uint32_t c) {
+    uint8_t *p;
+    if (n >= ctx->len) return;
+    c = ctxScale(ctx, c);
+    p = &ctx->pixels[n * 3];
+    p[ctx->rOffset] = c >> 16;
+    p[ctx->gOffset] = c >> 8;
+    p[ctx->bOffset] = c;
+}
+
+// add with saturation
+static inline void ctxAddPixelColor(PIXCTX_T *ctx, uint16_t n, uint32_t c) {
+    uint8_t *p;
+    uint16_t sr, sg, sb;
+    if (n >= ctx->len) return;
+    c = ctxScale(ctx, c);
+    p = &ctx->pixels[n * 3];
+    sr = p[ctx->rOffset] + (uint8_t)(c >> 16);
+    sg = p[ctx->gOffset] + (uint8_t)(c >> 8);
+    sb = p[ctx->bOffset] + (uint8_t)c;
+    p[ctx->rOffset] = sr > 255 ? 255 : sr;
+    p[ctx->gOffset] = sg > 255 ? 255 : sg;
+    p[ctx->bOffset] = sb > 255 ? 255 : sb;
+}
 
 // eof
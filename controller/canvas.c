@@ -0,0 +1,110 @@
+// world canvas and node layout
+//
+// layout file, one entry per line, '#' starts a comment:
+//   canvas <width> <height>
+//   <node id hex> <channel 0..3> <x0> <y0> <x1> <y1>
+// the LED_CNT pixels of the channel are placed on a straight line from
+// (x0,y0) to (x1,y1). Channels without an entry use the default layout:
+// one row, node id (low byte) * 4 + channel segments of LED_CNT pixels.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "adafruit.h"
+#include "patterns.h"
+#include "canvas.h"
+
+typedef struct {
+    uint16_t id, ch;
+    int32_t x0, y0, x1, y1;
+} PLACE_T;
+
+uint32_t *world;
+uint16_t worldW = 16*4*LED_CNT, worldH = 1;
+static PLACE_T *places;
+static uint16_t placeCnt;
+
+// read the layout file, returns -1 when it cannot be read
+int loadLayout(const char *path) {
+    FILE *f;
+    char line[128];
+    unsigned id, ch, w, h, n = 0;
+    int x0, y0, x1, y1;
+    PLACE_T *p;
+
+    if (!(f = fopen(path, "r"))) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line, "canvas %u %u", &w, &h) == 2) {
+            // the sizes are 16 bit, checked first so the area cannot wrap
+            if (w && h && w <= 0xffff && h <= 0xffff && (uint32_t)w * h <= 1u << 24) {
+                worldW = w; worldH = h;
+            }
+            else printf("%s:%u: canvas size ignored\n", path, n);
+            continue;
+        }
+        if (sscanf(line, "%x %u %d %d %d %d", &id, &ch, &x0, &y0, &x1, &y1) != 6 || ch > 3) {
+            printf("%s:%u: syntax error\n", path, n);
+            continue;
+        }
+        p = realloc(places, (placeCnt+1) * sizeof(PLACE_T));
+        if (!p) break;
+        places = p;
+        p += placeCnt++;
+        p->id = id; p->ch = ch;
+        p->x0 = x0; p->y0 = y0; p->x1 = x1; p->y1 = y1;
+    }
+    fclose(f);
+    return 0;
+}
+
+void initCanvas(void) {
+    world = calloc((uint32_t)worldW * worldH, sizeof(uint32_t));
+}
+
+// map pixel i of channel ch of a node to a canvas index
+static void mapChannel(NODE_T *node, uint16_t ch, uint32_t *map) {
+    uint16_t i, k;
+    int32_t x, y, d = LED_CNT > 1 ? LED_CNT-1 : 1;
+    PLACE_T *p = NULL;
+
+    for (k=0; k<placeCnt; k++)
+        if (places[k].id == node->id && places[k].ch == ch) { p = places+k; break; }
+    for (i=0; i<LED_CNT; i++) {
+        if (p) {
+            // rounded position on the line
+            x = p->x0 + ((p->x1 - p->x0) * i * 2 + d) / (2 * d);
+            y = p->y0 + ((p->y1 - p->y0) * i * 2 + d) / (2 * d);
+        } else {
+            x = (((node->id & 0xff) * 4 + ch) * LED_CNT + i) % worldW;
+            y = 0;
+        }
+        if (x < 0 || y < 0 || x >= worldW || y >= worldH) map[i] = CANVAS_NONE;
+        else map[i] = (uint32_t)y * worldW + x;
+    }
+}
+
+// (re)build the index map of a node, after registration or an id change
+void buildCanvasMap(NODE_T *node) {
+    uint16_t ch;
+    if (!node->cmap) node->cmap = malloc(4 * LED_CNT * sizeof(uint32_t));
+    if (!node->cmap) return;
+    for (ch=0; ch<4; ch++) mapChannel(node, ch, node->cmap + ch*LED_CNT);
+    node->cmapId = node->id;
+}
+
+// gather the channel pixels from the canvas
+void sampleCanvas(PIXCTX_T *ctx, const uint32_t *map) {
+    uint32_t col[LED_CNT];
+    uint16_t i, n = ctx->len < LED_CNT ? ctx->len : LED_CNT;
+    for (i=0; i<n; i++) col[i] = map[i] == CANVAS_NONE ? 0 : world[map[i]];
+    ctxWriteColors(ctx, 0, n, col);
+}
+
+// eof
@@ -0,0 +1,16 @@
+// canvas.c provides:
+// shared world canvas: a pattern renders the venue once per frame, each
+// node channel samples its pixels through a precomputed index map
+
+// map entry for pixels outside the canvas
+#define CANVAS_NONE 0xffffffff
+
+extern uint32_t *world;
+extern uint16_t worldW, worldH;
+
+int loadLayout(const char *path);
+void initCanvas(void);
+void buildCanvasMap(NODE_T *node);
+void sampleCanvas(PIXCTX_T *ctx, const uint32_t *map);
+
+// eof
@@ -0,0 +1,73 @@
+// packet encodings
+
+#include <stdint.h>
+#include <string.h>
+
+#include "encode.h"
+
+// encode the changes of pkt against ref (both full packets of len bytes)
+// into out, returns the encoded length or 0 if it would not be shorter
+uint16_t encodeDelta(uint8_t *out, const uint8_t *pkt, const uint8_t *ref,
+                    uint16_t len, uint8_t base) {
+    uint16_t i = 2, s, e, g, n = 3, c;
+
+    out[0] = pkt[0] | PKT_DELTA;
+    out[1] = pkt[1];
+    out[2] = base;
+    while (i < len) {
+        if (pkt[i] == ref[i]) { i++; continue; }
+        // span start, extend while changes are at most DELTA_GAP apart
+        s = e = i;
+        while (++i < len && i - s < 255) {
+            if (pkt[i] != ref[i]) e = i;
+            else if (i - e > DELTA_GAP) break;
+        }
+        c = e - s + 1;
+        if (n + 3 + c >= len) return 0;
+        g = s - 2;
+        out[n++] = g & 0xff;
+        out[n++] = g >> 8;
+        out[n++] = c;
+        memcpy(out + n, pkt + s, c);
+        n += c;
+        i = e + 1;
+    }
+    return n;
+}
+
+#define PAL_HASH 1024
+
+// palette encoding of a full packet of len bytes, returns the encoded
+// length or 0 if there are more than 256 colors or it is not shorter
+uint16_t encodePalette(uint8_t *out, const uint8_t *pkt, uint16_t len) {
+    uint32_t key[PAL_HASH], c;
+    uint8_t val[PAL_HASH], idx[256*3];
+    uint16_t i, h, n = 0, npix = (len - 2) / 3, hdr;
+    const uint8_t *p = pkt + 2;
+
+    if (npix > sizeof(idx)) return 0;
+    memset(key, 0xff, sizeof(key));
+    for (i=0; i<npix; i++, p+=3) {
+        c = p[0] | p[1] << 8 | (uint32_t)p[2] << 16;
+        h = (c * 2654435761u) >> 22;
+        while (key[h] != c && key[h] != 0xffffffff) h = (h+1) & (PAL_HASH-1);
+        if (key[h] == 0xffffffff) {
+            // new color, give up when the palette is full or too large
+            if (n == 256 || 3 + 3*(n+1) + npix >= len) return 0;
+            key[h] = c;
+            val[h] = n;
+            memcpy(out + 3 + 3*n, p, 3);
+            n++;
+        }
+        idx[i] = val[h];
+    }
+    if (!n) n = 1, memset(out + 3, 0, 3);
+    out[0] = pkt[0] | PKT_PALETTE;
+    out[1] = pkt[1];
+    out[2] = n - 1;
+    hdr = 3 + 3*n;
+    memcpy(out + hdr, idx, npix);
+    return hdr + npix;
+}
+
+// eof
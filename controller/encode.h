@@ -0,0 +1,34 @@
+// encode.c provides:
+// wire encodings of a channel packet, chosen per packet by the render stage
+// bit s (PKT_SHOW): the packet is followed by the presentation time of
+// its frame, 4 byte little endian, low 32 bit of the sender clock in us
+// (the domain of the time beacons); the node shows the frame then
+//
+// full:  000s4321, frame, pixel data
+// delta: 001s4321, frame, base frame, then spans of
+//        offset (2 byte little endian), count (1 byte), count bytes
+//        the node applies it only when it holds the base frame
+// palette: 010s4321, frame, palette size-1, 3 byte palette entries,
+//        then one palette index per pixel
+// multicast: 'm', frame, slice count, then per slice the node id (upper
+//        half of ctrid), offset and length of one of its packets in the
+//        datagram, 2 byte little endian each, then the packets
+
+// the group the nodes join, mcast_group of the firmware
+#define MC_GROUP "239.255.57.0"
+#define MC_HDR 3
+#define MC_SLICE 6
+#define MC_SLICE_MAX 255
+
+#define PKT_SHOW 0x10
+#define PTS_LEN 4
+#define PKT_DELTA 0x20
+#define PKT_PALETTE 0x40
+// a gap up to this size is cheaper to resend than to start a new span
+#define DELTA_GAP 3
+
+uint16_t encodeDelta(uint8_t *out, const uint8_t *pkt, const uint8_t *ref,
+                    uint16_t len, uint8_t base);
+uint16_t encodePalette(uint8_t *out, const uint8_t *pkt, uint16_t len);
+
+// eof
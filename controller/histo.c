@@ -0,0 +1,61 @@
+// histograms for timing statistics
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "histo.h"
+
+// values below 16 have their own bucket, above 8 buckets per power of 2
+static uint16_t histIndex(uint32_t v) {
+    uint16_t msb;
+    if (v < 16) return v;
+    msb = 31 - __builtin_clz(v);
+    return 16 + (msb-4) * 8 + ((v >> (msb-3)) & 7);
+}
+
+// highest value that falls into bucket i
+static uint32_t histUpper(uint16_t i) {
+    uint16_t msb;
+    if (i < 16) return i;
+    msb = (i-16) / 8 + 4;
+    return ((8u + (i-16) % 8 + 1) << (msb-3)) - 1;
+}
+
+void histReset(HIST_T *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT32_MAX;
+}
+
+void histAdd(HIST_T *h, uint32_t v) {
+    h->bucket[histIndex(v)]++;
+    h->cnt++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+// value below which permille/1000 of all samples are
+uint32_t histPercentile(HIST_T *h, uint16_t permille) {
+    uint64_t lim = (uint64_t)h->cnt * permille / 1000, acc = 0;
+    uint16_t i;
+    for (i=0; i<HIST_NR; i++) {
+        acc += h->bucket[i];
+        if (acc > lim) break;
+    }
+    if (i >= HIST_NR) return h->max;
+    return histUpper(i) < h->max ? histUpper(i) : h->max;
+}
+
+void histWrite(FILE *f, const char *name, HIST_T *h) {
+    if (!h->cnt) { fprintf (f, "%-10s no samples\n", name); return; }
+    fprintf (f, "%-10s n %7u  avg %6lu  p50 %6u  p90 %6u  p99 %6u  max %6u us\n",
+        name, h->cnt, (unsigned long)(h->sum / h->cnt), histPercentile(h, 500),
+        histPercentile(h, 900), histPercentile(h, 990), h->max);
+}
+
+void histPrint(const char *name, HIST_T *h) {
+    histWrite(stdout, name, h);
+}
+
+// eof
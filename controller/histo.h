@@ -0,0 +1,19 @@
+// histo.c provides:
+// log-linear histogram of microsecond values, 3 bit sub-bucket
+// precision (error below 12.5%), one writer, lock free readers
+
+#define HIST_NR 240
+
+typedef struct {
+    uint32_t cnt, min, max;
+    uint64_t sum;
+    uint32_t bucket[HIST_NR];
+} HIST_T;
+
+void histReset(HIST_T *h);
+void histAdd(HIST_T *h, uint32_t v);
+uint32_t histPercentile(HIST_T *h, uint16_t permille);
+void histPrint(const char *name, HIST_T *h);
+void histWrite(FILE *f, const char *name, HIST_T *h);
+
+// eof
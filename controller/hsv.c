@@ -0,0 +1,176 @@
+// batch color conversion
+// hue is scaled to 0..1530 as in ColorHSV(), then each channel is a
+// clamped trapezoid of the hue, which needs no branches:
+//   r = clamp(max(510-h, h-1020)), g = clamp(min(h, 1020-h)),
+//   b = clamp(min(h-510, 1530-h)), clamp to 0..255
+// saturation and value are applied with the same 16 bit arithmetic
+
+#include <stdint.h>
+
+#include "adafruit.h"
+#include "hsv.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define HSV_SIMD 1
+#endif
+
+// highest code path allowed: 0 scalar, 1 SSE2, 2 AVX2
+static uint8_t hsvMax = 2;
+
+void hsvLimit(uint8_t level) { hsvMax = level; }
+
+static void hsvScalar(const uint16_t *hue, const uint8_t *sat, const uint8_t *val,
+                        uint8_t s, uint8_t v, uint32_t *rgb, uint16_t n) {
+    uint16_t i;
+    for (i=0; i<n; i++)
+        rgb[i] = ColorHSV(hue[i], sat ? sat[i] : s, val ? val[i] : v);
+}
+
+#ifdef HSV_SIMD
+
+// 8 lanes of hue, saturation and value as 16 bit, returns r, g, b
+static inline void hsv8(__m128i hue, __m128i sat, __m128i val,
+                        __m128i *r, __m128i *g, __m128i *b) {
+    const __m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16(255);
+    const __m128i k1530 = _mm_set1_epi16(1530);
+    __m128i h, lo, s1, s2, v1;
+
+    // (hue * 1530 + 32768) >> 16, the rounding carry comes from bit 15
+    lo = _mm_mullo_epi16(hue, k1530);
+    h = _mm_add_epi16(_mm_mulhi_epu16(hue, k1530), _mm_srli_epi16(lo, 15));
+    *r = _mm_max_epi16(_mm_sub_epi16(_mm_set1_epi16(510), h),
+                       _mm_sub_epi16(h, _mm_set1_epi16(1020)));
+    *g = _mm_min_epi16(h, _mm_sub_epi16(_mm_set1_epi16(1020), h));
+    *b = _mm_min_epi16(_mm_sub_epi16(h, _mm_set1_epi16(510)),
+                       _mm_sub_epi16(k1530, h));
+    *r = _mm_min_epi16(_mm_max_epi16(*r, zero), c255);
+    *g = _mm_min_epi16(_mm_max_epi16(*g, zero), c255);
+    *b = _mm_min_epi16(_mm_max_epi16(*b, zero), c255);
+    // all products stay below 2^16
+    s1 = _mm_add_epi16(sat, _mm_set1_epi16(1));
+    s2 = _mm_sub_epi16(c255, sat);
+    v1 = _mm_add_epi16(val, _mm_set1_epi16(1));
+    *r = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(*r, s1), 8), s2);
+    *g = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(*g, s1), 8), s2);
+    *b = _mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(*b, s1), 8), s2);
+    *r = _mm_srli_epi16(_mm_mullo_epi16(*r, v1), 8);
+    *g = _mm_srli_epi16(_mm_mullo_epi16(*g, v1), 8);
+    *b = _mm_srli_epi16(_mm_mullo_epi16(*b, v1), 8);
+}
+
+static void hsvSse2(const uint16_t *hue, const uint8_t *sat, const uint8_t *val,
+                    uint8_t s, uint8_t v, uint32_t *rgb, uint16_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i hv, sv = _mm_set1_epi16(s), vv = _mm_set1_epi16(v), r, g, b, gb;
+    uint16_t i;
+
+    for (i=0; i+8 <= n; i+=8) {
+        hv = _mm_loadu_si128((const __m128i*)(hue+i));
+        if (sat) sv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(sat+i)), zero);
+        if (val) vv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(val+i)), zero);
+        hsv8(hv, sv, vv, &r, &g, &b);
+        gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+        _mm_storeu_si128((__m128i*)(rgb+i), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i*)(rgb+i+4), _mm_unpackhi_epi16(gb, r));
+    }
+    hsvScalar(hue+i, sat ? sat+i : NULL, val ? val+i : NULL, s, v, rgb+i, n-i);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HSV_AVX2 1
+
+// the same kernel on 16 lanes
+__attribute__((target("avx2")))
+static void hsvAvx2(const uint16_t *hue, const uint8_t *sat, const uint8_t *val,
+                    uint8_t s, uint8_t v, uint32_t *rgb, uint16_t n) {
+    const __m256i zero = _mm256_setzero_si256(), c255 = _mm256_set1_epi16(255);
+    const __m256i k1530 = _mm256_set1_epi16(1530);
+    __m256i h, lo, hv, s1, s2, v1, r, g, b, gb, o0, o1;
+    __m256i sv = _mm256_set1_epi16(s), vv = _mm256_set1_epi16(v);
+    uint16_t i;
+
+    for (i=0; i+16 <= n; i+=16) {
+        hv = _mm256_loadu_si256((const __m256i*)(hue+i));
+        if (sat) sv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(sat+i)));
+        if (val) vv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(val+i)));
+        lo = _mm256_mullo_epi16(hv, k1530);
+        h = _mm256_add_epi16(_mm256_mulhi_epu16(hv, k1530), _mm256_srli_epi16(lo, 15));
+        r = _mm256_max_epi16(_mm256_sub_epi16(_mm256_set1_epi16(510), h),
+                             _mm256_sub_epi16(h, _mm256_set1_epi16(1020)));
+        g = _mm256_min_epi16(h, _mm256_sub_epi16(_mm256_set1_epi16(1020), h));
+        b = _mm256_min_epi16(_mm256_sub_epi16(h, _mm256_set1_epi16(510)),
+                             _mm256_sub_epi16(k1530, h));
+        r = _mm256_min_epi16(_mm256_max_epi16(r, zero), c255);
+        g = _mm256_min_epi16(_mm256_max_epi16(g, zero), c255);
+        b = _mm256_min_epi16(_mm256_max_epi16(b, zero), c255);
+        s1 = _mm256_add_epi16(sv, _mm256_set1_epi16(1));
+        s2 = _mm256_sub_epi16(c255, sv);
+        v1 = _mm256_add_epi16(vv, _mm256_set1_epi16(1));
+        r = _mm256_add_epi16(_mm256_srli_epi16(_mm256_mullo_epi16(r, s1), 8), s2);
+        g = _mm256_add_epi16(_mm256_srli_epi16(_mm256_mullo_epi16(g, s1), 8), s2);
+        b = _mm256_add_epi16(_mm256_srli_epi16(_mm256_mullo_epi16(b, s1), 8), s2);
+        r = _mm256_srli_epi16(_mm256_mullo_epi16(r, v1), 8);
+        g = _mm256_srli_epi16(_mm256_mullo_epi16(g, v1), 8);
+        b = _mm256_srli_epi16(_mm256_mullo_epi16(b, v1), 8);
+        gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+        // unpack works per 128 bit lane, restore the element order
+        o0 = _mm256_unpacklo_epi16(gb, r);
+        o1 = _mm256_unpackhi_epi16(gb, r);
+        _mm256_storeu_si256((__m256i*)(rgb+i), _mm256_permute2x128_si256(o0, o1, 0x20));
+        _mm256_storeu_si256((__m256i*)(rgb+i+8), _mm256_permute2x128_si256(o0, o1, 0x31));
+    }
+    hsvSse2(hue+i, sat ? sat+i : NULL, val ? val+i : NULL, s, v, rgb+i, n-i);
+}
+
+static int hasAvx2(void) {
+    static int avx2 = -1;
+    if (avx2 < 0) avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return avx2;
+}
+#endif
+#endif
+
+// code path in use, limited by hsvLimit() and the CPU
+static uint8_t hsvLevel(void) {
+    uint8_t l = 0;
+#ifdef HSV_SIMD
+    l = 1;
+#endif
+#ifdef HSV_AVX2
+    if (hasAvx2()) l = 2;
+#endif
+    return l < hsvMax ? l : hsvMax;
+}
+
+static void hsvRun(const uint16_t *hue, const uint8_t *sat, const uint8_t *val,
+                    uint8_t s, uint8_t v, uint32_t *rgb, uint16_t n) {
+    switch (hsvLevel()) {
+#ifdef HSV_AVX2
+        case 2: hsvAvx2(hue, sat, val, s, v, rgb, n); break;
+#endif
+#ifdef HSV_SIMD
+        case 1: hsvSse2(hue, sat, val, s, v, rgb, n); break;
+#endif
+        default: hsvScalar(hue, sat, val, s, v, rgb, n); break;
+    }
+}
+
+const char *hsvPath(void) {
+    static const char *names[] = { "scalar", "sse2", "avx2" };
+    return names[hsvLevel()];
+}
+
+// one saturation and value per pixel
+void ColorHSVBatch(const uint16_t *hue, const uint8_t *sat, const uint8_t *val,
+                    uint32_t *rgb, uint16_t n) {
+    hsvRun(hue, sat, val, 0, 0, rgb, n);
+}
+
+// same saturation and value for all pixels
+void ColorHSVHues(const uint16_t *hue, uint8_t sat, uint8_t val,
+                    uint32_t *rgb, uint16_t n) {
+    hsvRun(hue, NULL, NULL, sat, val, rgb, n);
+}
+
+// eof
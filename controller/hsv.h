@@ -0,0 +1,12 @@
+// hsv.c provides:
+// batch HSV => packed RGB conversion, bit exact with ColorHSV()
+// uses AVX2 or SSE2 when available, scalar code otherwise
+
+void ColorHSVBatch(const uint16_t *hue, const uint8_t *sat, const uint8_t *val,
+                    uint32_t *rgb, uint16_t n);
+void ColorHSVHues(const uint16_t *hue, uint8_t sat, uint8_t val,
+                    uint32_t *rgb, uint16_t n);
+void hsvLimit(uint8_t level);  // 0 scalar, 1 SSE2, 2 AVX2
+const char *hsvPath(void);
+
+// eof
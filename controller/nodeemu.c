@@ -0,0 +1,513 @@
+// node emulator: one or many ESP8266 nodes speaking the firmware UDP
+// protocol, for load and regression tests of the sender on one host
+//
+// each node binds its own address on port 5700, consecutive loopback
+// addresses by default (127.0.0.2, 127.0.0.3, ...), and sends its alive
+// packet "a<ctrid>/<packets>/<frames>/<lost>/<duplicates>/<reordered>/<late>"
+// to port 5701 of the server. Packets are handled like handleUDP does:
+// 'c' commands (only the id 'i' is applied), 's' sync shows the frame,
+// 't' time beacons are ignored as the nodes share the sender's clock,
+// anything else is a full, delta or palette channel packet written to
+// the node's pin buffers through its mapping and shown at its
+// presentation time, 'm' multicast frames hand each node the slices of
+// its id. Broadcasts and multicast frames are received on a shared
+// wildcard socket.
+//
+// a line is printed every report interval:
+//   t nodes streaming fps_rx fps_show pkts kbyte lost dup ooo stale late
+// fps_rx: frames received per node and second, fps_show: shows per node
+// and second, stale: delta packets dropped for a missing base frame,
+// late: frames whose presentation time had passed on arrival, followed
+// by the show latency (first data packet of a frame to its show) over
+// all nodes; -v adds one line per node
+//
+// -n <n>: nodes (default 1), -a <addr>: address of the first node,
+// -s <addr>: server address (default 127.0.0.1), -i <ctrid>: hex
+// controller id of the first node (default 00011234), following nodes
+// count up the id in the upper 16 bit, -r <s>: report interval (1),
+// -t <s>: stop after s seconds, -v: per node report,
+// -m <group>: join the multicast group of the sender
+// -l <pct>: the last node drops pct percent of its data packets, like a
+// node at the edge of WiFi range
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "patterns.h"
+#include "encode.h"
+#include "histo.h"
+
+#define PORT 5700
+#define PIN_BUF (3*LED_CNT)
+// larger gaps are a restarted stream, not loss (firmware SEQ_RESYNC)
+#define SEQ_RESYNC 32
+// without data for this long the node falls back to its own program
+#define STREAM_MS 3000
+// receive buffer of the shared wildcard socket (capped by rmem_max)
+#define WILD_RCVBUF (1 << 20)
+
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    uint32_t ctrid;
+    uint8_t pix[4*PIN_BUF];
+    // frame held per logical channel, sequence tracking as on the node
+    uint8_t chFrame[4], chValid, seqLast[4], seqValid, rxFrame;
+    uint32_t rxPkts, rxFrames, rxLost, rxDup, rxReorder;
+    uint32_t shows, stale, late, bytes;
+    // pixel mode, time of the last data packet and the first of the
+    // frame not shown yet (0 = none), last alive packet
+    int streaming;
+    uint64_t dataUs, pendUs, aliveUs;
+    // frame waiting for its presentation time showAt
+    uint8_t showPend, showFrame;
+    uint32_t showAt;
+} EMU_T;
+
+static volatile int running = 1;
+static EMU_T *emu;
+static uint16_t emuCnt = 1, dropPct = 0;
+static struct sockaddr_in server;
+static int syncFd = -1;
+static HIST_T hShow;
+// node by id, for the multicast slices
+static EMU_T **byId;
+
+static uint64_t nowUs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000ull + t.tv_nsec / 1000;
+}
+
+static void stop(int sig) {
+    running = 0;
+}
+
+// ######################################################################
+
+// the id is the only command of interest to the sender
+static void handleCommand(EMU_T *e, uint8_t *rt, uint16_t len) {
+    uint32_t hexval = 0;
+    uint16_t i;
+    uint8_t cmd = 0, cval, idc = 0;
+
+    for (i=0; i<len; i++) {
+        if (!cmd) { cmd = rt[i]; continue; }
+        cval = rt[i];
+        if (cval >= 'a') cval -= 'a'-10;
+        else if (cval >= 'A') cval -= 'A'-10;
+        else cval -= '0';
+        switch (cmd) {
+            case 'i':
+            hexval = hexval << 4 | cval;
+            if (++idc >= 8) {
+                printf("%s: id %08x => %08x\n", inet_ntoa(e->addr.sin_addr), e->ctrid, hexval);
+                if (byId[e->ctrid >> 16] == e) byId[e->ctrid >> 16] = NULL;
+                byId[hexval >> 16] = e;
+                e->ctrid = hexval;
+                idc = 0;
+                cmd = 0;
+            }
+            break;
+            // multi digit values
+            case 't': case 'h': case 'e': case 'g':
+            if (++idc >= 4) { idc = 0; cmd = 0; }
+            break;
+            default: cmd = 0; break;
+        }
+    }
+}
+
+static void show(EMU_T *e, uint64_t now) {
+    e->showPend = 0;
+    if (!e->streaming) return;
+    e->shows++;
+    if (e->pendUs) histAdd(&hShow, now - e->pendUs);
+    e->pendUs = 0;
+}
+
+// show the frame at its presentation time, like loop() on the node,
+// returns us until the next one is due, at most max
+static uint64_t showCheck(uint64_t now, uint64_t max) {
+    uint16_t i;
+    int32_t d;
+    EMU_T *e;
+
+    for (i=0; i<emuCnt; i++) {
+        e = emu + i;
+        if (!e->showPend) continue;
+        d = e->showAt - (uint32_t)now;
+        if (d <= 0) show(e, now);
+        else if ((uint64_t)d < max) max = d;
+    }
+    return max;
+}
+
+// copy n bytes to offset off of all pins the channels in cmd are mapped to
+static void writeChannels(EMU_T *e, uint8_t cmd, uint16_t off, uint8_t *data, uint16_t n) {
+    uint16_t map = e->ctrid & 0xffff;
+    uint8_t *pix = e->pix;
+
+    if (off >= PIN_BUF) return;
+    if (n > PIN_BUF - off) n = PIN_BUF - off;
+    while (map) {
+        if (map & cmd & 0x0f) memcpy(pix + off, data, n);
+        pix += PIN_BUF;
+        map >>= 4;
+    }
+}
+
+// like the firmware: a gap counts once per packet, in the unit of rxPkts
+static void trackSeq(EMU_T *e, uint8_t cmd, uint8_t frame) {
+    uint8_t c, d, gap = 0;
+
+    e->rxPkts++;
+    if (!e->seqValid) e->rxFrame = frame - 1;
+    d = frame - e->rxFrame;
+    if (d && d < 128) { e->rxFrames++; e->rxFrame = frame; }
+    for (c=0; c<4; c++) {
+        if (!(cmd & (1<<c))) continue;
+        d = frame - e->seqLast[c];
+        if (e->seqValid & (1<<c)) {
+            if (d == 0) e->rxDup++;
+            else if (d >= 128) { e->rxReorder++; continue; }
+            else if (d <= SEQ_RESYNC && d - 1 > gap) gap = d - 1;
+        }
+        e->seqLast[c] = frame;
+        e->seqValid |= 1<<c;
+    }
+    e->rxLost += gap;
+}
+
+// changes to the base frame, only applied when all channels hold it
+static void handleDelta(EMU_T *e, uint8_t *rt, uint16_t len) {
+    uint8_t cmd = rt[0], frame = rt[1], base = rt[2], c, n;
+    uint16_t off;
+
+    for (c=0; c<4; c++) {
+        if (!(cmd & (1<<c))) continue;
+        if (!(e->chValid & (1<<c)) || e->chFrame[c] != base) {
+            e->chValid &= ~cmd;
+            e->stale++;
+            return;
+        }
+    }
+    rt += 3;
+    len -= 3;
+    while (len >= 3) {
+        off = rt[0] | (rt[1] << 8);
+        n = rt[2];
+        rt += 3;
+        len -= 3;
+        if (n > len) break;
+        writeChannels(e, cmd, off, rt, n);
+        rt += n;
+        len -= n;
+    }
+    for (c=0; c<4; c++) if (cmd & (1<<c)) e->chFrame[c] = frame;
+}
+
+static void handlePalette(EMU_T *e, uint8_t *rt, uint16_t len) {
+    uint16_t map = e->ctrid & 0xffff, pcnt = rt[2] + 1, n, i;
+    uint8_t cmd = rt[0], *pal = rt + 3, *idx = pal + 3*pcnt, *pix = e->pix, *d, *s, c;
+
+    if (len < 3 + 3*pcnt) return;
+    n = len - 3 - 3*pcnt;
+    if (n > LED_CNT) n = LED_CNT;
+    while (map) {
+        if (map & cmd & 0x0f) {
+            d = pix;
+            for (i=0; i<n; i++) {
+                s = idx[i] < pcnt ? pal + 3*idx[i] : pal;
+                *d++ = s[0];
+                *d++ = s[1];
+                *d++ = s[2];
+            }
+        }
+        pix += PIN_BUF;
+        map >>= 4;
+    }
+    for (c=0; c<4; c++) if (cmd & (1<<c)) e->chFrame[c] = rt[1];
+    e->chValid |= cmd & 0x0f;
+}
+
+static void handleBinary(EMU_T *e, uint8_t *rt, uint16_t len, uint64_t now) {
+    uint8_t cmd = rt[0], c;
+    uint32_t pts = 0;
+    int32_t d;
+
+    if (len < 3) return;
+    if (dropPct && e == emu + emuCnt - 1 && rand() % 100 < dropPct) return;
+    if (cmd & PKT_SHOW) {
+        if (len < 3 + PTS_LEN) return;
+        len -= PTS_LEN;
+        pts = rt[len] | rt[len+1] << 8 | rt[len+2] << 16 | (uint32_t)rt[len+3] << 24;
+    }
+    trackSeq(e, cmd, rt[1]);
+    // a newer frame overwrites the pixels: show the pending one now
+    if (e->showPend && rt[1] != e->showFrame) show(e, now);
+    if (!e->streaming) {
+        e->streaming = 1;
+        e->chValid = 0;
+    }
+    e->bytes += len;
+    e->dataUs = now;
+    if (!e->pendUs) e->pendUs = now;
+    if (cmd & PKT_DELTA) handleDelta(e, rt, len);
+    else if (cmd & PKT_PALETTE) handlePalette(e, rt, len);
+    else {
+        writeChannels(e, cmd, 0, rt+2, len-2);
+        for (c=0; c<4; c++) if (cmd & (1<<c)) e->chFrame[c] = rt[1];
+        e->chValid |= cmd & 0x0f;
+    }
+    if (!(cmd & PKT_SHOW)) return;
+    // the nodes share the sender's clock, a time far off is from a
+    // sender on another host: show right away
+    d = pts - (uint32_t)now;
+    if (d < -1000000 || d > 1000000) pts = now;
+    else if (d < 0 && !(e->showPend && e->showFrame == rt[1])) e->late++;
+    e->showPend = 1;
+    e->showFrame = rt[1];
+    e->showAt = pts;
+}
+
+// 'm', frame, slice count, per slice id, offset and length
+static void handleSlices(uint8_t *rt, uint16_t len, uint64_t now) {
+    uint16_t n, i, off, sl;
+    uint8_t *s = rt + MC_HDR;
+    EMU_T *e;
+
+    if (len < MC_HDR) return;
+    n = rt[2];
+    if (len < MC_HDR + MC_SLICE*n) return;
+    for (i=0; i<n; i++, s += MC_SLICE) {
+        if (!(e = byId[s[0] | (s[1] << 8)])) continue;
+        off = s[2] | (s[3] << 8);
+        sl = s[4] | (s[5] << 8);
+        if (off >= len || sl > len - off) continue;
+        handleBinary(e, rt + off, sl, now);
+    }
+}
+
+static void handleUDP(EMU_T *e, uint8_t *pkt, uint16_t len, uint64_t now) {
+    uint16_t i;
+
+    if (!len) return;
+    switch (pkt[0]) {
+        case 'c': if (e) handleCommand(e, pkt+1, len-1); break;
+        case 's':
+        // the broadcast reaches all nodes
+        if (e) show(e, now);
+        else for (i=0; i<emuCnt; i++) show(emu+i, now);
+        break;
+        case 'a': case 't': break;
+        case 'm': handleSlices(pkt, len, now); break;
+        default: if (e) handleBinary(e, pkt, len, now);
+    }
+}
+
+// ######################################################################
+
+static void sendAlive(EMU_T *e) {
+    char buf[128];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "a%08x/%x/%x/%x/%x/%x/%x",
+        e->ctrid, e->rxPkts, e->rxFrames, e->rxLost, e->rxDup, e->rxReorder, e->late);
+    sendto(e->fd, buf, len, 0, (struct sockaddr*)&server, sizeof(server));
+}
+
+// alive every 2 s, every second while streaming with the statistics
+static void aliveCheck(uint64_t now) {
+    uint16_t i;
+    EMU_T *e;
+
+    for (i=0; i<emuCnt; i++) {
+        e = emu + i;
+        if (e->streaming && now - e->dataUs > STREAM_MS * 1000ull) e->streaming = 0;
+        if (now - e->aliveUs >= (e->streaming ? 1000000ull : 2000000ull)) {
+            sendAlive(e);
+            e->aliveUs = now;
+        }
+    }
+}
+
+static int bindUdp(struct in_addr ip) {
+    struct sockaddr_in a;
+    int fd, on = 1;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+    // the wildcard sync socket shares the port with the nodes
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(PORT);
+    a.sin_addr = ip;
+    if (bind(fd, (struct sockaddr*)&a, sizeof(a)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void report(double t, double dt, int verbose) {
+    static uint32_t lastFrames, lastShows, lastPkts;
+    static uint64_t lastBytes;
+    uint32_t frames = 0, shows = 0, pkts = 0, lost = 0, dup = 0, ooo = 0, stale = 0, late = 0;
+    uint64_t bytes = 0;
+    uint16_t i, on = 0;
+    EMU_T *e;
+
+    if (dt <= 0) dt = 1;
+    for (i=0; i<emuCnt; i++) {
+        e = emu + i;
+        frames += e->rxFrames;
+        shows += e->shows;
+        pkts += e->rxPkts;
+        bytes += e->bytes;
+        lost += e->rxLost;
+        dup += e->rxDup;
+        ooo += e->rxReorder;
+        stale += e->stale;
+        late += e->late;
+        on += e->streaming;
+        if (verbose)
+            printf("  %15s  id %08x  frames %u  shows %u  pkts %u  lost %u  dup %u  ooo %u  stale %u  late %u\n",
+                inet_ntoa(e->addr.sin_addr), e->ctrid, e->rxFrames, e->shows,
+                e->rxPkts, e->rxLost, e->rxDup, e->rxReorder, e->stale, e->late);
+    }
+    printf("%.1f %u %u %.1f %.1f %u %.1f %u %u %u %u %u\n", t, emuCnt, on,
+        (frames - lastFrames) / dt / emuCnt, (shows - lastShows) / dt / emuCnt,
+        pkts - lastPkts, (bytes - lastBytes) / 1024.0, lost, dup, ooo, stale, late);
+    histPrint("show", &hShow);
+    fflush(stdout);
+    lastFrames = frames;
+    lastShows = shows;
+    lastPkts = pkts;
+    lastBytes = bytes;
+}
+
+int main(int argc, char* argv[]) {
+    struct in_addr first;
+    struct ip_mreq mreq;
+    struct pollfd *pfd;
+    struct sockaddr_in from;
+    socklen_t flen;
+    uint64_t t0, now, next, wait;
+    struct timespec ts;
+    uint32_t ctrid = 0x00011234, period = 1, duration = 0;
+    uint8_t buf[2048];
+    uint16_t i;
+    ssize_t len;
+    int opt, verbose = 0, n, group = 0, rcvbuf;
+    EMU_T *e;
+
+    inet_aton("127.0.0.2", &first);
+    inet_aton("127.0.0.1", &server.sin_addr);
+    memset(&mreq, 0, sizeof(mreq));
+    while ((opt = getopt(argc, argv, "n:a:s:i:r:t:vm:l:")) != -1) {
+        switch (opt) {
+            case 'n': emuCnt = atoi(optarg); break;
+            case 'a': if (!inet_aton(optarg, &first)) emuCnt = 0; break;
+            case 's': if (!inet_aton(optarg, &server.sin_addr)) emuCnt = 0; break;
+            case 'i': ctrid = strtoul(optarg, NULL, 16); break;
+            case 'r': period = atoi(optarg); break;
+            case 't': duration = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            case 'l': dropPct = atoi(optarg); break;
+            case 'm': group = inet_aton(optarg, &mreq.imr_multiaddr); if (!group) emuCnt = 0; break;
+            default: emuCnt = 0; break;
+        }
+    }
+    if (!emuCnt) {
+        fprintf(stderr, "usage: %s [-n nodes] [-a first address] [-s server] [-i ctrid] [-r report] [-t seconds] [-v] [-m group] [-l loss]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (period < 1) period = 1;
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT+1);
+    emu = calloc(emuCnt, sizeof(EMU_T));
+    pfd = calloc(emuCnt + 1, sizeof(struct pollfd));
+    byId = calloc(65536, sizeof(EMU_T*));
+    if (!emu || !pfd || !byId) {
+        perror("allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (i=0; i<emuCnt; i++) {
+        e = emu + i;
+        e->addr.sin_family = AF_INET;
+        e->addr.sin_addr.s_addr = htonl(ntohl(first.s_addr) + i);
+        e->ctrid = ctrid + ((uint32_t)i << 16);
+        byId[e->ctrid >> 16] = e;
+        if ((e->fd = bindUdp(e->addr.sin_addr)) < 0) {
+            perror(inet_ntoa(e->addr.sin_addr));
+            exit(EXIT_FAILURE);
+        }
+        pfd[i].fd = e->fd;
+        pfd[i].events = POLLIN;
+    }
+    first.s_addr = INADDR_ANY;
+    if ((syncFd = bindUdp(first)) < 0) perror("sync socket");
+    // the multicast frames of all nodes queue up here, zero copy sends
+    // are charged with the pinned pages on loopback
+    rcvbuf = WILD_RCVBUF;
+    if (syncFd >= 0) setsockopt(syncFd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    if (group && syncFd >= 0 &&
+        setsockopt(syncFd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        perror("multicast group");
+    pfd[emuCnt].fd = syncFd;
+    pfd[emuCnt].events = POLLIN;
+    histReset(&hShow);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    printf("t nodes streaming fps_rx fps_show pkts kbyte lost dup ooo stale late\n");
+    t0 = next = nowUs();
+    // spread the alive packets of the nodes over the 2 s interval, a
+    // burst of all of them would overflow the receive buffer of the sender
+    for (i=0; i<emuCnt; i++) emu[i].aliveUs = t0 - 2000000ull + 2000000ull * i / emuCnt;
+    while (running) {
+        now = nowUs();
+        aliveCheck(now);
+        if (now >= next + period * 1000000ull) {
+            report((now - t0) / 1e6, (now - next) / 1e6, verbose);
+            next = now;
+        }
+        if (duration && now - t0 >= duration * 1000000ull) break;
+        wait = showCheck(now, 100000);
+        ts.tv_sec = 0;
+        ts.tv_nsec = wait * 1000;
+        n = ppoll(pfd, emuCnt + 1, &ts, NULL);
+        if (n < 0 && errno != EINTR) break;
+        for (i=0; n > 0 && i<=emuCnt; i++) {
+            if (!(pfd[i].revents & POLLIN)) continue;
+            // drain the socket, a node sees up to 4 packets per frame
+            for (;;) {
+                flen = sizeof(from);
+                len = recvfrom(pfd[i].fd, buf, sizeof(buf), MSG_DONTWAIT,
+                               (struct sockaddr*)&from, &flen);
+                if (len <= 0) break;
+                handleUDP(i < emuCnt ? emu + i : NULL, buf, len, nowUs());
+            }
+        }
+    }
+    // a short last interval would give meaningless rates
+    now = nowUs();
+    if (now - next >= period * 500000ull) report((now - t0) / 1e6, (now - next) / 1e6, verbose);
+    for (i=0; i<emuCnt; i++) close(emu[i].fd);
+    if (syncFd >= 0) close(syncFd);
+    return 0;
+}
+
+// eof
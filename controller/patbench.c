@@ -0,0 +1,147 @@
+// headless render benchmark for the patterns
+// registers synthetic nodes without networking and renders each pattern
+// for a fixed number of frames on the worker pool; output: a header line,
+// then one line per pattern with whitespace separated columns:
+//   pattern name nodes workers frames ns_frame ns_pixel mbyte_s allocs alloc_kb budget_pct
+// ns_pixel relates to all channel pixels drawn, mbyte_s to the packet
+// bytes written per second of render time, budget_pct to the frame period
+// at -r fps. Allocations are counted in the timed frames only, after the
+// warm-up frames that build the per-node maps and reference buffers.
+//
+// -n <n>: nodes (default 18), -f <n>: frames (default 300),
+// -w <n>: render workers (default 1), -r <fps>: frame rate budget (30)
+// -d <n>: delta encoding keyframe interval, -p: palette encoding
+// -l <file>: node layout on the world canvas
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "adafruit.h"
+#include "patterns.h"
+#include "canvas.h"
+
+#define WARMUP 10
+
+// allocation counter, linked with --wrap=malloc,calloc,realloc
+static volatile int counting;
+static uint32_t allocs;
+static uint64_t allocBytes;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t m, size_t n);
+void *__real_realloc(void *p, size_t n);
+
+static void countAlloc(size_t n) {
+    if (!counting) return;
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocBytes, n, __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t n) { countAlloc(n); return __real_malloc(n); }
+void *__wrap_calloc(size_t m, size_t n) { countAlloc(m * n); return __real_calloc(m, n); }
+void *__wrap_realloc(void *p, size_t n) { countAlloc(n); return __real_realloc(p, n); }
+
+static NODE_T *nodes;
+static uint16_t *slots;
+static uint8_t *share;
+
+// synthetic nodes: distinct ids place them side by side on the canvas
+static int initNodes(uint16_t cnt) {
+    uint16_t i;
+
+    nodes = calloc(cnt, sizeof(NODE_T));
+    slots = malloc(cnt * sizeof(uint16_t));
+    share = malloc(FRAME_RING * SHARE_BUF);
+    if (!nodes || !slots || !share) return -1;
+    for (i=0; i<cnt; i++) {
+        nodes[i].ip = htonl(0x0a000001 + i);
+        nodes[i].id = i;
+        nodes[i].mapping = 0x1234;
+        nodes[i].len = 3*LED_CNT+2;
+        if (!(nodes[i].ring = malloc(FRAME_RING * NODE_BUF))) return -1;
+        slots[i] = i;
+    }
+    return 0;
+}
+
+// render frames into the ring slots in turn, returns ns, counts the
+// pixels drawn and the packet bytes produced
+static uint64_t render(uint16_t cnt, uint32_t frames, uint16_t *frame,
+                       uint64_t *pixels, uint64_t *bytes) {
+    struct timespec t0, t1;
+    uint32_t f;
+    uint16_t i, k, d;
+    NODE_T *node;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (f=0; f<frames; f++) {
+        d = *frame % FRAME_RING;
+        for (i=0; i<cnt; i++) nodes[i].pkt = nodes[i].ring + d*NODE_BUF;
+        createPkt(nodes, slots, cnt, (*frame)++, share + d*SHARE_BUF);
+        for (i=0; i<cnt; i++) {
+            node = nodes + i;
+            *pixels += (uint64_t)node->cnt * ((node->len - 2) / 3);
+            for (k=0; k<node->cnt; k++) *bytes += node->plen[k];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0.tv_sec) * 1000000000ull + (t1.tv_nsec - t0.tv_nsec);
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t ns, pixels, bytes;
+    uint32_t frames = 300;
+    uint16_t cnt = 18, workers = 1, fps = 30, t, frame = 0;
+    int opt;
+    double nsFrame;
+
+    while ((opt = getopt(argc, argv, "n:f:w:r:d:pl:")) != -1) {
+        switch (opt) {
+            case 'n': cnt = atoi(optarg); break;
+            case 'f': frames = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 'r': fps = atoi(optarg); break;
+            case 'd': setDelta(atoi(optarg)); break;
+            case 'p': setPalette(1); break;
+            case 'l': if (loadLayout(optarg) < 0) exit(EXIT_FAILURE); break;
+            default:
+            fprintf(stderr, "usage: %s [-n nodes] [-f frames] [-w workers] [-r fps] [-d keyint] [-p] [-l layout]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cnt < 1) cnt = 1;
+    if (frames < 1) frames = 1;
+    if (fps < 1) fps = 30;
+    if (initNodes(cnt) < 0) {
+        perror("node allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    setBrightness(3);
+    initPool(workers);
+    printf("pattern name nodes workers frames ns_frame ns_pixel mbyte_s allocs alloc_kb budget_pct\n");
+    for (t=0; t<=PAT_NR; t++) {
+        setPattern(t, 0);
+        pixels = bytes = 0;
+        render(cnt, WARMUP, &frame, &pixels, &bytes);
+        pixels = bytes = 0;
+        allocs = 0;
+        allocBytes = 0;
+        counting = 1;
+        ns = render(cnt, frames, &frame, &pixels, &bytes);
+        counting = 0;
+        nsFrame = (double)ns / frames;
+        printf("%u %s %u %u %u %.0f %.2f %.1f %u %.1f %.2f\n",
+            t, patternName(t), cnt, poolSize(), frames, nsFrame,
+            pixels ? (double)ns / pixels : 0, ns ? bytes * 1e3 / ns : 0,
+            allocs, allocBytes / 1024.0, nsFrame * fps / 1e7);
+    }
+    exitPool();
+    return 0;
+}
+
+// eof
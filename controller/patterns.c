@@ -1,180 +1,472 @@
 // pattern generator
+// a frame is split into (node, channel) tasks, which are drawn by a pool
+// of workers; each worker steals from the others when its own queue is empty
 
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "adafruit.h"
+#include "hsv.h"
 #include "patterns.h"
+#include "canvas.h"
+#include "encode.h"
 
 uint16_t type=1, mode=0;
+// delta encoding: keyframe interval, 0 = always full packets
+// palette encoding used when it is the shortest
+uint16_t deltaKey=0, palette=0;
 
 void setPattern(uint16_t t, uint16_t m) {
     type = t;
     mode = m;
 }
 
+uint16_t patternType(void) {
+    return type;
+}
+
+void setDelta(uint16_t keyint) {
+    deltaKey = keyint;
+}
+
+void setPalette(uint16_t on) {
+    palette = on;
+}
+
+// per worker render context
+typedef struct {
+    PIXCTX_T pix;       // pixel data of the channel, after the packet header
+    uint32_t rng;       // xorshift32 state
+    uint8_t cmd;        // channel bit field of the packet
+} RCTX_T;
+
+// layout: number of packets for a node and their channel bit fields
+// draw: pixels of one packet, runs in parallel on the workers
+// share: index of the shared pixel data the packet gets, -1 for its own;
+//        packets with the same index get the same pixels, drawn once,
+//        so draw must not depend on the node for them; may be NULL
+// step: advance the pattern state once per frame, may be NULL
+// canvas: render the world canvas once per frame before the draw tasks,
+//         NULL for patterns that draw per node
+typedef struct {
+    uint16_t (*layout)(NODE_T *node, uint16_t ix, uint8_t *cmds);
+    void (*draw)(RCTX_T *ctx, NODE_T *node, uint16_t ix, uint16_t ch, uint16_t frame);
+    void (*step)(void);
+    void (*canvas)(uint16_t frame);
+    int16_t (*share)(NODE_T *node, uint16_t ix, uint16_t ch);
+    const char *name;
+} PATTERN_T;
+
+static uint32_t rnd(RCTX_T *ctx) {
+    uint32_t x = ctx->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return ctx->rng = x;
+}
+
 // pattern 0: identify node location and wired LED strips
 // mode = selected node index
-void testPattern(NODE_T* nodes, uint16_t frame) {
-    uint16_t i = 0;
-    uint8_t* p;
-
-    while (i < NODE_NR) {
-        NODE_T* node = nodes + i++;
-        if (!node->fd) continue;
-        p = node->pkt;
-        // focus on the selected node
-        if (mode == i-1) {
-            memset(p, 0, node->len*4);
-            *p++ = 0x01;
-            *p++ = frame;
-            setPixels (p);
-            setPixelColor(0, 0x00ffffff);
-            p += node->len-2;
-            *p++ = 0x02;
-            *p++ = frame;
-            setPixels (p);
-            setPixelColor(1, 0x00ffffff);
-            p += node->len-2;
-            *p++ = 0x04;
-            *p++ = frame;
-            setPixels (p);
-            setPixelColor(2, 0x00ffffff);
-            p += node->len-2;
-            *p++ = 0x08;
-            *p++ = frame;
-            setPixels (p);
-            setPixelColor(3, 0x00ffffff);
-            node->cnt = 4;
-        } else {
-            memset(p, 0, node->len);
-            *p++ = 0x0f;
-            *p++ = frame;
-            node->cnt = 1;
-        }
+uint16_t testLayout(NODE_T *node, uint16_t ix, uint8_t *cmds) {
+    // focus on the selected node
+    if (mode == ix) {
+        cmds[0] = 0x01; cmds[1] = 0x02; cmds[2] = 0x04; cmds[3] = 0x08;
+        return 4;
     }
+    cmds[0] = 0x0f;
+    return 1;
 }
 
-void runningDots(NODE_T* nodes, uint16_t frame) {
-    uint16_t i=0, col;
-    uint8_t* p;
-    static uint16_t pix=0;
-
-    while (i < NODE_NR) {
-        NODE_T* node = nodes+i++;
-        if (!node->fd) continue;
-        p = node->pkt;
-        col = frame * 256;
-        if (pix >= 100) pix = 0;
-        memset(p, 0, node->len*4);
-        *p++ = 0x01;
-        *p++ = frame;
-        setPixels (p);
-        setPixelColor(pix, ColorHSV(col, 255, 255));
-        p += node->len-2;
-        *p++ = 0x02;
-        *p++ = frame;
-        setPixels (p);
-        setPixelColor(LED_CNT-1-pix, ColorHSV(col, 255, 255));
-        p += node->len-2;
-        *p++ = 0x04;
-        *p++ = frame;
-        setPixels (p);
-        setPixelColor(pix, ColorHSV(col, 255, 255));
-        p += node->len-2;
-        *p++ = 0x08;
-        *p++ = frame;
-        setPixels (p);
-        setPixelColor(LED_CNT-1-pix, ColorHSV(col, 255, 255));
-        node->cnt = 4;
-    }
-    pix++;
+void testPattern(RCTX_T *ctx, NODE_T *node, uint16_t ix, uint16_t ch, uint16_t frame) {
+    if (mode == ix) ctxSetPixelColor(&ctx->pix, ch, 0x00ffffff);
+}
+
+// all other nodes are dark
+int16_t testShare(NODE_T *node, uint16_t ix, uint16_t ch) {
+    return mode == ix ? -1 : 0;
+}
+
+uint16_t allLayout(NODE_T *node, uint16_t ix, uint8_t *cmds) {
+    cmds[0] = 0x01; cmds[1] = 0x02; cmds[2] = 0x04; cmds[3] = 0x08;
+    return 4;
+}
+
+static uint16_t dotpix=0;
+
+void runningDots(RCTX_T *ctx, NODE_T *node, uint16_t ix, uint16_t ch, uint16_t frame) {
+    uint16_t col = frame * 256;
+    ctxSetPixelColor(&ctx->pix, ch & 1 ? LED_CNT-1-dotpix : dotpix, ColorHSV(col, 255, 255));
+}
+
+void runningDotsStep(void) {
+    if (++dotpix >= 100) dotpix = 0;
+}
+
+// the same dots on every node, even and odd channels mirrored
+int16_t runningDotsShare(NODE_T *node, uint16_t ix, uint16_t ch) {
+    return ch & 1;
 }
 
 // multiple synchronious wandering trains in changing colors
-void trains(NODE_T* nodes, uint16_t frame) {
-    uint16_t nix=0, id, fid, i;
+// position, size, speed (step size relative to 2^16)
+static uint16_t trainpix=0, psz=10, pstep=800;
+
+uint16_t oneLayout(NODE_T *node, uint16_t ix, uint8_t *cmds) {
+    cmds[0] = 0x0f;
+    return 1;
+}
+
+void trains(RCTX_T *ctx, NODE_T *node, uint16_t ix, uint16_t ch, uint16_t frame) {
+    uint16_t id, fid;
     uint32_t col, im;
-    uint8_t* p;
-    // position, size, speed (step size relative to 2^16)
-    static uint16_t pix=0, psz=10, pstep=800;
-
-    while (nix < NODE_NR) {
-        NODE_T* node = nodes+nix;
-        nix++;
-        if (!node->fd) continue;
-        id = node->id & 0x00ff;
-        p = node->pkt;
-        fid = frame + id * 50;
-        col = ColorHSV(fid * 256, 255, 255);
-        memset(p, 0, node->len);
-        *p++ = 0x0f;
-        *p++ = frame;
-        setPixels (p);
-        im = pix * LED_CNT / 65536;
-        for (i=0; i < psz; i++) {
-            if (im >= LED_CNT) im = 0;
-            setPixelColor(im++, col);
-        }
-        node->cnt = 1;
-    }
-    pix += pstep;
+
+    id = node->id & 0x00ff;
+    fid = frame + id * 50;
+    col = ColorHSV(fid * 256, 255, 255);
+    im = trainpix * LED_CNT / 65536;
+    // the train wraps around at the end of the strip
+    ctxFillColor(&ctx->pix, im, psz, col);
+    if (im + psz > LED_CNT) ctxFillColor(&ctx->pix, 0, im + psz - LED_CNT, col);
+}
+
+void trainsStep(void) {
+    trainpix += pstep;
 }
 
 #define SPOTS_NR 25
 // many random spots in random colors
-void spotflash(NODE_T* nodes, uint16_t frame) {
-    uint16_t nix=0, i;
-    uint32_t col, pix;
-    uint8_t* p;
-
-    while (nix < NODE_NR) {
-        NODE_T* node = nodes+nix;
-        nix++;
-        if (!node->fd) continue;
-        p = node->pkt;
-        memset(p, 0, node->len*3);
-        *p++ = 0x02;
-        *p++ = frame;
-        setPixels (p);
-        for (i=0; i < SPOTS_NR; i++) {
-            pix = random() % 180;
-            col = ColorHSV(random() % 0xffff, 255, 255);
-            setPixelColor(pix, col);
+uint16_t spotLayout(NODE_T *node, uint16_t ix, uint8_t *cmds) {
+    cmds[0] = 0x02; cmds[1] = 0x04; cmds[2] = 0x08;
+    return 3;
+}
+
+void spotflash(RCTX_T *ctx, NODE_T *node, uint16_t ix, uint16_t ch, uint16_t frame) {
+    uint16_t i, pix[SPOTS_NR], hue[SPOTS_NR];
+    uint32_t col[SPOTS_NR];
+
+    for (i=0; i < SPOTS_NR; i++) {
+        pix[i] = rnd(ctx) % 180;
+        hue[i] = rnd(ctx) % 0xffff;
+    }
+    ColorHSVHues(hue, 255, 255, col, SPOTS_NR);
+    for (i=0; i < SPOTS_NR; i++) ctxSetPixelColor(&ctx->pix, pix[i], col[i]);
+}
+
+// ######################################################################
+// world canvas patterns: render once, every node samples its channels
+
+// one packet per logical channel that is wired to a pin
+uint16_t canvasLayout(NODE_T *node, uint16_t ix, uint8_t *cmds) {
+    uint16_t used = 0, map = node->mapping, c, n = 0;
+    while (map) { used |= map & 0x0f; map >>= 4; }
+    for (c=0; c<4; c++) if (used & (1 << c)) cmds[n++] = 1 << c;
+    return n;
+}
+
+void canvasSample(RCTX_T *ctx, NODE_T *node, uint16_t ix, uint16_t ch, uint16_t frame) {
+    uint16_t c = 0;
+    while (c < 3 && !(ctx->cmd & (1 << c))) c++;
+    if (node->cmap) sampleCanvas(&ctx->pix, node->cmap + c*LED_CNT);
+}
+
+// rainbow over the whole venue, slowly rotating, tilted along y
+void worldRainbow(uint16_t frame) {
+    uint16_t x, y, hue[256];
+    uint32_t *row;
+
+    for (y=0; y<worldH; y++) {
+        row = world + (uint32_t)y * worldW;
+        for (x=0; x<worldW; x++) {
+            hue[x & 255] = (uint32_t)x * 65536 / worldW + y * 256 + frame * 128;
+            if ((x & 255) == 255 || x == worldW-1)
+                ColorHSVHues(hue, 255, 255, row + (x & ~255), (x & 255) + 1);
+        }
+    }
+}
+
+// trains running across all nodes, a few pixels per frame
+#define WTRAIN_NR 8
+#define WTRAIN_LEN 12
+void worldTrains(uint16_t frame) {
+    uint16_t t, y, i;
+    uint32_t x, col, *row;
+
+    memset(world, 0, (uint32_t)worldW * worldH * sizeof(uint32_t));
+    for (y=0; y<worldH; y++) {
+        row = world + (uint32_t)y * worldW;
+        for (t=0; t<WTRAIN_NR; t++) {
+            col = ColorHSV(t * 65536 / WTRAIN_NR + frame * 64, 255, 255);
+            x = ((uint32_t)t * worldW / WTRAIN_NR + frame * 3 + y * 17) % worldW;
+            for (i=0; i<WTRAIN_LEN; i++) row[(x + i) % worldW] = col;
         }
-        p += node->len-2;
-        *p++ = 0x04;
-        *p++ = frame;
-        setPixels (p);
-        for (i=0; i < SPOTS_NR; i++) {
-            pix = random() % 180;
-            col = ColorHSV(random() % 0xffff, 255, 255);
-            setPixelColor(pix, col);
+    }
+}
+
+static const PATTERN_T patterns[PAT_NR+1] = {
+    { testLayout, testPattern, NULL, NULL, testShare, "testPattern" },
+    { allLayout, runningDots, runningDotsStep, NULL, runningDotsShare, "runningDots" },
+    { oneLayout, trains, trainsStep, NULL, NULL, "trains" },
+    { spotLayout, spotflash, NULL, NULL, NULL, "spotflash" },
+    { canvasLayout, canvasSample, NULL, worldRainbow, NULL, "worldRainbow" },
+    { canvasLayout, canvasSample, NULL, worldTrains, NULL, "worldTrains" },
+};
+
+const char *patternName(uint16_t t) {
+    return t > PAT_NR ? "" : patterns[t].name;
+}
+
+// ######################################################################
+
+#define WORKER_MAX 64
+
+// node slot and packet index, ref: the packet shares pixel data that
+// another task draws
+typedef struct {
+    uint16_t node, ch;
+    uint8_t ref;
+} TASK_T;
+
+// range: queue of tasks, head in the low and tail in the high 16 bit,
+// the owner takes from the head, thieves from the tail
+// encNs: time spent encoding packets in the current frame
+typedef struct {
+    pthread_t thread;
+    RCTX_T ctx;
+    uint32_t range;
+    uint64_t encNs;
+} WORKER_T;
+
+// grows with the node count, 4 packets per node at most
+static TASK_T *tasks;
+static uint32_t taskMax;
+static WORKER_T workers[WORKER_MAX];
+static uint16_t workerCnt = 0, taskFrame;
+static uint8_t taskBri;
+static NODE_T *taskNodes;
+static const PATTERN_T *taskPat;
+static pthread_barrier_t startBar, doneBar;
+static volatile int poolRun;
+static uint32_t encUs;
+
+static uint64_t nowNs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static int popTask(WORKER_T *w, TASK_T **t) {
+    uint32_t r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+    uint16_t h, tl;
+    do {
+        h = r & 0xffff;
+        tl = r >> 16;
+        if (h >= tl) return 0;
+    } while (!__atomic_compare_exchange_n(&w->range, &r, r + 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    *t = tasks + h;
+    return 1;
+}
+
+static int stealTask(WORKER_T *self, TASK_T **t) {
+    uint16_t i, h, tl;
+    uint32_t r;
+    WORKER_T *w;
+
+    for (i=1; i<workerCnt; i++) {
+        w = workers + (self - workers + i) % workerCnt;
+        r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+        do {
+            h = r & 0xffff;
+            tl = r >> 16;
+            if (h >= tl) break;
+        } while (!__atomic_compare_exchange_n(&w->range, &r, r - 0x10000, 0,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        if (h < tl) {
+            *t = tasks + tl - 1;
+            return 1;
         }
-        p += node->len-2;
-        *p++ = 0x08;
-        *p++ = frame;
-        setPixels (p);
-        for (i=0; i < SPOTS_NR; i++) {
-            pix = random() % 180;
-            col = ColorHSV(random() % 0xffff, 255, 255);
-            setPixelColor(pix, col);
+    }
+    return 0;
+}
+
+// replace a full packet by the shortest encoding: its changes to the
+// node's previous frame (except for keyframes, which are staggered over
+// the nodes) or a palette with one index per pixel
+static void encodeTask(NODE_T *node, uint16_t ix, uint16_t k, uint8_t *p) {
+    uint8_t tmp[3*LED_CNT+2], pal[3*LED_CNT+2], *ref;
+    uint16_t n = 0, m = 0;
+
+    if (node->len > sizeof(tmp)) return;
+    if (palette) m = encodePalette(pal, p, node->len);
+    if (!deltaKey || !node->ref) node->refCmd[k] = 0;
+    else {
+        ref = node->ref + k*node->len;
+        if (node->refCmd[k] == p[0] && (node->seq + ix) % deltaKey)
+            n = encodeDelta(tmp, p, ref, node->len, node->seq - 1);
+        memcpy(ref, p, node->len);
+        node->refCmd[k] = p[0];
+    }
+    if (m && (!n || m < n)) {
+        memcpy(p, pal, m);
+        node->plen[k] = m;
+    } else if (n) {
+        memcpy(p, tmp, n);
+        node->plen[k] = n;
+    }
+}
+
+// packet header, cleared pixel data, then the pattern draws the channel;
+// shared pixel data is drawn by the first of its packets and never
+// encoded, as the nodes' references differ
+static void drawTask(WORKER_T *w, TASK_T *t) {
+    NODE_T *node = taskNodes + t->node;
+    uint8_t *p = node->pkt + t->ch * node->len, *pix = node->pay[t->ch];
+    uint64_t t0;
+
+    p[0] = node->cmd[t->ch] | PKT_SHOW;
+    p[1] = node->seq;
+    node->plen[t->ch] = node->len;
+    if (t->ref) return;
+    memset(pix, 0, node->len - 2);
+    w->ctx.cmd = p[0];
+    ctxInit(&w->ctx.pix, pix, (node->len - 2) / 3);
+    w->ctx.pix.brightness = taskBri;
+    taskPat->draw(&w->ctx, node, t->node, t->ch, taskFrame);
+    if (pix != p + 2) return;
+    t0 = nowNs();
+    encodeTask(node, t->node, t->ch, p);
+    w->encNs += nowNs() - t0;
+}
+
+static void runTasks(WORKER_T *w) {
+    TASK_T *t;
+    while (popTask(w, &t) || stealTask(w, &t)) drawTask(w, t);
+}
+
+static void* workLoop(void* arg) {
+    WORKER_T *w = (WORKER_T*) arg;
+    while (1) {
+        pthread_barrier_wait(&startBar);
+        if (!poolRun) break;
+        runTasks(w);
+        pthread_barrier_wait(&doneBar);
+    }
+    return NULL;
+}
+
+// the calling thread is worker 0, n-1 more threads are created
+void initPool(uint16_t n) {
+    uint16_t i;
+
+    if (n < 1) n = 1;
+    if (n > WORKER_MAX) n = WORKER_MAX;
+    workerCnt = n;
+    poolRun = 1;
+    for (i=0; i<n; i++) workers[i].ctx.rng = 0x9e3779b9u * (i+1);
+    pthread_barrier_init(&startBar, NULL, n);
+    pthread_barrier_init(&doneBar, NULL, n);
+    for (i=1; i<n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, workLoop, workers+i) != 0) {
+            // continue with the workers we have
+            workerCnt = i;
+            break;
         }
-        node->cnt = 3;
+    }
+    if (workerCnt < n) {
+        pthread_barrier_destroy(&startBar);
+        pthread_barrier_destroy(&doneBar);
+        pthread_barrier_init(&startBar, NULL, workerCnt);
+        pthread_barrier_init(&doneBar, NULL, workerCnt);
     }
 }
 
+void exitPool(void) {
+    uint16_t i;
+    poolRun = 0;
+    if (workerCnt > 1) pthread_barrier_wait(&startBar);
+    for (i=1; i<workerCnt; i++) pthread_join(workers[i].thread, NULL);
+    pthread_barrier_destroy(&startBar);
+    pthread_barrier_destroy(&doneBar);
+    workerCnt = 0;
+}
+
+uint16_t poolSize(void) { return workerCnt; }
+
+// encoding time of the last frame, summed over the workers
+uint32_t encodeUsec(void) { return encUs; }
 
-// create 1..4 instances of pixel data of same length
+// create 1..4 instances of pixel data of same length for the cnt nodes
+// in slots, the slot index identifies the node to the pattern
 //  // 0x1F = all 4 + show
-void createPkt(NODE_T* node, uint16_t frame) {
-    switch (type) {
-        case 0: testPattern (node, frame); break;
-        case 1: runningDots (node, frame); break;
-        case 2: trains (node, frame); break;
-        case 3: spotflash (node, frame); break;
+// share: SHARE_BUF bytes for the pixel data shared in this frame, NULL
+// to draw every packet; not used with delta or palette encoding
+void createPkt(NODE_T* nodes, uint16_t *slots, uint16_t cnt, uint16_t frame,
+               uint8_t *share) {
+    uint8_t drawn[SHARE_NR] = { 0 };
+    uint16_t i, j, k, c, w;
+    int16_t s;
+    uint32_t n = 0;
+    uint64_t encNs;
+    NODE_T *node;
+    TASK_T *t;
+
+    if (type > PAT_NR) return;
+    if (!workerCnt) initPool(1);
+    if (4u * cnt > taskMax) {
+        if (!(t = realloc(tasks, 4u * cnt * sizeof(TASK_T)))) return;
+        tasks = t;
+        taskMax = 4u * cnt;
+    }
+    taskPat = patterns + type;
+    taskNodes = nodes;
+    taskFrame = frame;
+    taskBri = getBrightness();
+    if (taskPat->canvas) {
+        if (!world) initCanvas();
+        if (!world) return;
+        taskPat->canvas(frame);
+    }
+    for (j=0; j<cnt; j++) {
+        i = slots[j];
+        node = nodes + i;
+        if (taskPat->canvas && (!node->cmap || node->cmapId != node->id))
+            buildCanvasMap(node);
+        if (deltaKey && !node->ref) node->ref = malloc(4 * node->len);
+        c = taskPat->layout(node, i, node->cmd);
+        node->seq++;
+        for (k=0; k<c; k++) {
+            tasks[n].node = i;
+            tasks[n].ch = k;
+            tasks[n].ref = 0;
+            node->pay[k] = node->pkt + k*node->len + 2;
+            s = share && taskPat->share && !deltaKey && !palette
+                && node->len == 3*LED_CNT+2 ? taskPat->share(node, i, k) : -1;
+            if (s >= 0 && s < SHARE_NR) {
+                node->pay[k] = share + s*3*LED_CNT;
+                tasks[n].ref = drawn[s];
+                drawn[s] = 1;
+            }
+            n++;
+        }
+        node->cnt = c;
+    }
+    // contiguous share per worker keeps a node's channels together
+    for (w=0; w<workerCnt; w++) {
+        workers[w].range = (n * w / workerCnt) | (uint32_t)(n * (w+1) / workerCnt) << 16;
+        workers[w].encNs = 0;
     }
+    if (workerCnt > 1) {
+        // the barrier orders the task setup before the workers start
+        pthread_barrier_wait(&startBar);
+        runTasks(workers);
+        pthread_barrier_wait(&doneBar);
+    } else runTasks(workers);
+    for (w=0, encNs=0; w<workerCnt; w++) encNs += workers[w].encNs;
+    encUs = encNs / 1000;
+    if (taskPat->step) taskPat->step();
 }
 
 // eof
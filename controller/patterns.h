@@ -1,20 +1,54 @@
 // patterns.c
 
+// render -> send pipeline depth: drawing, ready, sending
+#define FRAME_RING 3
+// packet buffer per node and ring slot: 4 channels of 3 byte LED_CNT pixel + header
+#define NODE_BUF (4*(3*LED_CNT+2))
+// pixel data shared by packets of several channels or nodes, per ring slot
+#define SHARE_NR 4
+#define SHARE_BUF (SHARE_NR*3*LED_CNT)
+
 // id stored on node, defines position, legs (2/3/4 strips) and pixel count
-// - 0: 4 x NODE_NR LEDs
 // len used for UDP packet length, including header
 // mapping from logical to physical channels, 0x1234 = identical
+// ip in network byte order, 0 marks an unused slot
+// cmd: channel bit fields of the cnt packets of the frame being rendered
+// seq: frame number on the wire, counts the frames rendered for the node
+// (nodes at a lower rate skip frames), so a gap is always a lost frame
+// pkt points to the ring slot being rendered, rcnt holds cnt per slot;
+// a packet is its header in the ring slot and the pixel data at pay,
+// right behind the header or in the shared buffer, rpay per slot
+// plen: encoded length of the packets being rendered, rlen per slot
+// ref: last rendered full packets, refCmd their headers (0 = none)
+// cmap: canvas index of each channel pixel, built for node id cmapId
 typedef struct {
-    int fd;
-    uint16_t id, len, mapping, cnt;
-    uint8_t *pkt;
+    uint32_t ip;
+    uint16_t id, len, mapping, cnt, seq;
+    uint8_t cmd[4];
+    uint8_t *pkt, *ring;
+    uint8_t *pay[4], *rpay[FRAME_RING][4];
+    uint16_t rcnt[FRAME_RING];
+    uint16_t plen[4], rlen[FRAME_RING][4];
+    uint8_t *ref, refCmd[4];
+    uint32_t *cmap;
+    uint16_t cmapId;
 } NODE_T;
 
-void createPkt(NODE_T* node, uint16_t frame);
+void createPkt(NODE_T* nodes, uint16_t *slots, uint16_t cnt, uint16_t frame,
+               uint8_t *share);
 void setPattern(uint16_t type, uint16_t mode);
+const char *patternName(uint16_t type);
+uint16_t patternType(void);
+void setDelta(uint16_t keyint);
+void setPalette(uint16_t on);
+void initPool(uint16_t workers);
+void exitPool(void);
+uint16_t poolSize(void);
+uint32_t encodeUsec(void);
 
-#define NODE_NR 18
+// default number of node slots, see sender -n
+#define NODE_NR 256
 #define LED_CNT 200
-#define PAT_NR 3
+#define PAT_NR 5
 
 // eof
@@ -0,0 +1,338 @@
+// frame recording and playback
+// the render stage appends the packets of each frame it completes, as
+// they went out on the wire (encoded), starting with a keyframe, one
+// column per node registered when the recording started. Nodes that joined later are not recorded,
+// a column of a node that is gone holds no packets.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "patterns.h"
+#include "registry.h"
+#include "record.h"
+
+// frames the file grows by, ~10 MB with 20 nodes
+#define REC_GROW 256
+
+static pthread_mutex_t recMutex = PTHREAD_MUTEX_INITIALIZER;
+static int recFd = -1;
+static uint8_t *recMap;
+static size_t recLen;
+static RECHDR_T *recHdr;
+static uint16_t *recSlot;
+static RECIDX_T *recIdx;
+static uint32_t recIdxMax;
+static struct timespec recT0;
+// set by recStart until the render stage forces a keyframe, no frame
+// is recorded before it
+static int recKey;
+
+// playback: the mapped file and the node addresses
+static uint8_t *playMap;
+static size_t playLen;
+static RECHDR_T *playHdr;
+static RECIDX_T *playIdx;
+static struct sockaddr_in *playAddr;
+
+// ######################################################################
+
+static size_t frameAt(RECHDR_T *h, uint32_t n) {
+    return h->frameOff + (size_t)n * h->stride;
+}
+
+// extend the file and the mapping for another REC_GROW frames
+static int recGrow(void) {
+    size_t len = frameAt(recHdr, recHdr->frames + REC_GROW);
+    uint8_t *m;
+
+    if (ftruncate(recFd, len) < 0) return -1;
+    m = mremap(recMap, recLen, len, MREMAP_MAYMOVE);
+    if (m == MAP_FAILED) return -1;
+    recMap = m;
+    recLen = len;
+    recHdr = (RECHDR_T*)m;
+    return 0;
+}
+
+static void recClose(void) {
+    if (recMap) munmap(recMap, recLen);
+    if (recFd >= 0) close(recFd);
+    free(recSlot);
+    free(recIdx);
+    recMap = NULL;
+    recHdr = NULL;
+    recSlot = NULL;
+    recIdx = NULL;
+    recFd = -1;
+}
+
+// start recording the nodes of tab, -1 when the file cannot be written
+int recStart(const char *path, uint16_t fps, NODETAB_T *tab) {
+    RECNODE_T *rn;
+    NODE_T *node;
+    uint16_t i;
+    size_t off;
+
+    pthread_mutex_lock(&recMutex);
+    if (recFd >= 0 || !tab->cnt) goto fail;
+    if ((recFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(path);
+        goto fail;
+    }
+    off = sizeof(RECHDR_T) + tab->cnt * sizeof(RECNODE_T);
+    off = (off + 4095) & ~(size_t)4095;
+    recLen = off;
+    if (ftruncate(recFd, recLen) < 0 ||
+        (recMap = mmap(NULL, recLen, PROT_READ|PROT_WRITE, MAP_SHARED, recFd, 0)) == MAP_FAILED) {
+        perror(path);
+        recMap = NULL;
+        recClose();
+        goto fail;
+    }
+    recHdr = (RECHDR_T*)recMap;
+    memcpy(recHdr->magic, REC_MAGIC, sizeof(recHdr->magic));
+    recHdr->version = REC_VERSION;
+    recHdr->fps = fps;
+    recHdr->nodes = tab->cnt;
+    recHdr->stride = tab->cnt * (sizeof(RECSLOT_T) + NODE_BUF);
+    recHdr->frames = 0;
+    recHdr->frameOff = off;
+    recHdr->indexOff = 0;
+    recSlot = malloc(tab->cnt * sizeof(uint16_t));
+    if (!recSlot) {
+        recClose();
+        goto fail;
+    }
+    rn = (RECNODE_T*)(recHdr + 1);
+    for (i=0; i<tab->cnt; i++) {
+        node = nodes + tab->slot[i];
+        recSlot[i] = tab->slot[i];
+        rn[i].ip = tab->addr[i].sin_addr.s_addr;
+        rn[i].ctrid = (uint32_t)node->id << 16 | node->mapping;
+        rn[i].len = node->len;
+        rn[i].pad = 0;
+    }
+    recKey = 1;
+    pthread_mutex_unlock(&recMutex);
+    return 0;
+fail:
+    pthread_mutex_unlock(&recMutex);
+    return -1;
+}
+
+// called by the render stage before it draws a frame: 1 when a
+// recording has started, the frame is to be encoded as keyframe so the
+// recording can be played and looped from its first frame
+int recKeyframe(void) {
+    int key;
+
+    pthread_mutex_lock(&recMutex);
+    key = recKey;
+    recKey = 0;
+    // the index times count from the keyframe
+    if (key) clock_gettime(CLOCK_MONOTONIC, &recT0);
+    pthread_mutex_unlock(&recMutex);
+    return key;
+}
+
+// append the packets in ring slot ring, called by the render stage
+void recFrame(uint8_t ring, uint16_t frame) {
+    RECNODE_T *rn;
+    RECSLOT_T *rs;
+    RECIDX_T *x;
+    NODE_T *node;
+    struct timespec now;
+    uint8_t *p;
+    uint16_t i, k;
+
+    pthread_mutex_lock(&recMutex);
+    if (!recHdr || recKey) goto done;
+    if (frameAt(recHdr, recHdr->frames + 1) > recLen && recGrow() < 0) {
+        perror("recording stopped");
+        pthread_mutex_unlock(&recMutex);
+        recStop();
+        return;
+    }
+    if (recHdr->frames >= recIdxMax) {
+        x = realloc(recIdx, (recIdxMax + REC_GROW) * sizeof(RECIDX_T));
+        if (!x) goto done;
+        recIdx = x;
+        recIdxMax += REC_GROW;
+    }
+    rn = (RECNODE_T*)(recHdr + 1);
+    p = recMap + frameAt(recHdr, recHdr->frames);
+    for (i=0; i<recHdr->nodes; i++) {
+        rs = (RECSLOT_T*)p;
+        node = nodes + recSlot[i];
+        memset(rs, 0, sizeof(RECSLOT_T));
+        // the slot may have been taken over by another node meanwhile
+        if (node->ip == rn[i].ip) {
+            rs->cnt = node->rcnt[ring];
+            // header and pixel data, which may be shared, as one packet
+            for (k=0; k<rs->cnt && k<4; k++) {
+                rs->plen[k] = node->rlen[ring][k];
+                memcpy(p + sizeof(RECSLOT_T) + k * node->len,
+                       node->ring + ring*NODE_BUF + k * node->len, 2);
+                memcpy(p + sizeof(RECSLOT_T) + k * node->len + 2,
+                       node->rpay[ring][k], rs->plen[k] - 2);
+            }
+        }
+        p += sizeof(RECSLOT_T) + NODE_BUF;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    recIdx[recHdr->frames].frame = frame;
+    recIdx[recHdr->frames].usec = (now.tv_sec - recT0.tv_sec) * 1000000L
+                                + (now.tv_nsec - recT0.tv_nsec) / 1000;
+    recHdr->frames++;
+done:
+    pthread_mutex_unlock(&recMutex);
+}
+
+// write the index behind the frames and cut the file, returns the
+// number of frames recorded, -1 if none was running
+int recStop(void) {
+    int n = -1;
+    off_t off;
+    size_t len;
+
+    pthread_mutex_lock(&recMutex);
+    if (recHdr) {
+        n = recHdr->frames;
+        off = frameAt(recHdr, n);
+        len = n * sizeof(RECIDX_T);
+        recHdr->indexOff = off;
+        if (ftruncate(recFd, off + len) < 0 ||
+            (len && pwrite(recFd, recIdx, len, off) != (ssize_t)len)) {
+            perror("recording index");
+            recHdr->frames = 0;
+        }
+        msync(recMap, sizeof(RECHDR_T), MS_SYNC);
+        recClose();
+    }
+    pthread_mutex_unlock(&recMutex);
+    return n;
+}
+
+int recActive(void) {
+    return recHdr != NULL;
+}
+
+// ######################################################################
+
+// map a recording and check its layout, -1 when it cannot be played
+int playOpen(const char *path, uint16_t port, uint16_t *fps, uint16_t *nodes) {
+    struct stat st;
+    RECNODE_T *rn;
+    uint16_t i;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    playLen = st.st_size;
+    playMap = playLen < sizeof(RECHDR_T) ? MAP_FAILED
+            : mmap(NULL, playLen, PROT_READ, MAP_SHARED|MAP_POPULATE, fd, 0);
+    close(fd);
+    if (playMap == MAP_FAILED) {
+        fprintf(stderr, "%s: not a recording\n", path);
+        playMap = NULL;
+        return -1;
+    }
+    playHdr = (RECHDR_T*)playMap;
+    if (memcmp(playHdr->magic, REC_MAGIC, sizeof(playHdr->magic)) ||
+        playHdr->version != REC_VERSION || !playHdr->frames || !playHdr->nodes || !playHdr->fps ||
+        playHdr->stride != playHdr->nodes * (sizeof(RECSLOT_T) + NODE_BUF) ||
+        playHdr->frameOff < sizeof(RECHDR_T) + playHdr->nodes * sizeof(RECNODE_T) ||
+        playHdr->indexOff < frameAt(playHdr, playHdr->frames) ||
+        playHdr->indexOff + playHdr->frames * sizeof(RECIDX_T) > playLen) {
+        fprintf(stderr, "%s: not a complete recording\n", path);
+        playClose();
+        return -1;
+    }
+    rn = (RECNODE_T*)(playHdr + 1);
+    for (i=0; i<playHdr->nodes; i++) {
+        if (rn[i].len > NODE_BUF / 4) {
+            fprintf(stderr, "%s: bad node table\n", path);
+            playClose();
+            return -1;
+        }
+    }
+    playAddr = calloc(playHdr->nodes, sizeof(struct sockaddr_in));
+    if (!playAddr) {
+        playClose();
+        return -1;
+    }
+    for (i=0; i<playHdr->nodes; i++) {
+        playAddr[i].sin_family = AF_INET;
+        playAddr[i].sin_port = htons(port);
+        playAddr[i].sin_addr.s_addr = rn[i].ip;
+    }
+    playIdx = (RECIDX_T*)(playMap + playHdr->indexOff);
+    *fps = playHdr->fps;
+    *nodes = playHdr->nodes;
+    printf("playing %u frames of %u nodes at %u fps\n",
+        playHdr->frames, playHdr->nodes, playHdr->fps);
+    return 0;
+}
+
+// the frame after pos, the recording repeats; *us: the recorded time
+// between the two, a period at the recorded rate where it loops or the
+// index time does not go forward
+uint32_t playNext(uint32_t pos, long *us) {
+    uint32_t next = pos + 1 < playHdr->frames ? pos + 1 : 0;
+    uint32_t d = playIdx[next].usec - playIdx[pos].usec;
+
+    *us = next && d && d < 1000000 ? (long)d : 1000000L / playHdr->fps;
+    return next;
+}
+
+// point the message vector at the packets of recorded frame pos; the
+// packet of message n goes in iov[2*n], the caller owns the odd entries;
+// returns the number of packets
+uint16_t playPkts(struct mmsghdr *msg, struct iovec *iov, uint32_t pos,
+                    uint16_t *frame, uint32_t *bytes, uint32_t *raw) {
+    RECNODE_T *rn = (RECNODE_T*)(playHdr + 1);
+    RECSLOT_T *rs;
+    uint8_t *p;
+    uint16_t i, k, n = 0;
+
+    *bytes = *raw = 0;
+    if (pos >= playHdr->frames) pos = 0;
+    p = playMap + frameAt(playHdr, pos);
+    for (i=0; i<playHdr->nodes; i++) {
+        rs = (RECSLOT_T*)p;
+        for (k=0; k<rs->cnt && k<4; k++) {
+            iov[2*n].iov_base = p + sizeof(RECSLOT_T) + k * rn[i].len;
+            iov[2*n].iov_len = rs->plen[k] <= rn[i].len ? rs->plen[k] : rn[i].len;
+            msg[n].msg_hdr.msg_name = playAddr + i;
+            *bytes += iov[2*n].iov_len;
+            *raw += rn[i].len;
+            n++;
+        }
+        p += sizeof(RECSLOT_T) + NODE_BUF;
+    }
+    *frame = playIdx[pos].frame;
+    return n;
+}
+
+void playClose(void) {
+    if (playMap) munmap(playMap, playLen);
+    free(playAddr);
+    playMap = NULL;
+    playHdr = NULL;
+    playAddr = NULL;
+}
+
+// eof
@@ -0,0 +1,48 @@
+// record.c provides:
+// frame recordings: header, node table, fixed-stride frames and the frame
+// index, in this order. Frames are appended through a growing shared
+// mapping, playback sends straight from the mapped pages.
+
+#define REC_MAGIC "LEDREC1"
+// version 2: packets flagged PKT_SHOW, sent with a presentation time
+#define REC_VERSION 2
+
+// offsets from the start of the file, frames and index valid once the
+// recording has been stopped (frames = 0 before)
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint16_t fps, nodes;
+    uint32_t stride, frames;
+    uint64_t frameOff, indexOff;
+} RECHDR_T;
+
+// recorded node, ip in network byte order, ctrid = id << 16 | mapping
+typedef struct {
+    uint32_t ip, ctrid;
+    uint16_t len, pad;
+} RECNODE_T;
+
+// per node and frame, followed by NODE_BUF bytes of packet data
+typedef struct {
+    uint16_t cnt, plen[4], pad;
+} RECSLOT_T;
+
+// frame number and microseconds since the recording started
+typedef struct {
+    uint32_t frame, usec;
+} RECIDX_T;
+
+int recStart(const char *path, uint16_t fps, NODETAB_T *tab);
+int recKeyframe(void);
+void recFrame(uint8_t ring, uint16_t frame);
+int recStop(void);
+int recActive(void);
+
+int playOpen(const char *path, uint16_t port, uint16_t *fps, uint16_t *nodes);
+uint32_t playNext(uint32_t pos, long *us);
+uint16_t playPkts(struct mmsghdr *msg, struct iovec *iov, uint32_t pos,
+                    uint16_t *frame, uint32_t *bytes, uint32_t *raw);
+void playClose(void);
+
+// eof
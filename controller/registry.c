@@ -0,0 +1,342 @@
+// node registry
+// the receive thread is the only writer: it adds, rekeys and expires
+// nodes and publishes a new node table for each change. The render and
+// transmit stages pin the current table per frame ring slot, a retired
+// table and the slots of removed nodes are reused once no pin refers
+// to them any more.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "patterns.h"
+#include "registry.h"
+
+// a node showing up with a new address takes over the entry with the
+// same controller id when that was silent for this long (node reboot),
+// several nodes with the same id that are all alive stay separate
+#define REKEY_MS 5000
+#define HASH_MIN 64
+
+// open addressing, linear probing, grows at half load
+typedef struct {
+    uint32_t *key;
+    uint16_t *val;
+    uint32_t size, used;
+} HASH_T;
+
+NODE_T *nodes;
+uint16_t nodeMax;
+volatile uint16_t nodecnt = 0;
+
+static uint16_t nodePort;
+// per slot: controller id, time of the last alive packet and the table
+// generation that dropped it
+static uint32_t *ctrids, *seen, *gone;
+static uint16_t *freeSlots, freeCnt, *limbo, limboCnt;
+static HASH_T byIp, byId;
+static NODETAB_T *current, *retired, *pins[PIN_NR];
+static pthread_mutex_t regMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t nowMs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// ######################################################################
+
+static uint32_t hashPos(HASH_T *h, uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x & (h->size - 1);
+}
+
+static int hashInit(HASH_T *h, uint32_t size) {
+    h->key = malloc(size * sizeof(uint32_t));
+    h->val = malloc(size * sizeof(uint16_t));
+    if (!h->key || !h->val) {
+        free(h->key);
+        free(h->val);
+        return -1;
+    }
+    memset(h->val, 0xff, size * sizeof(uint16_t));
+    h->size = size;
+    h->used = 0;
+    return 0;
+}
+
+static uint16_t hashGet(HASH_T *h, uint32_t key) {
+    uint32_t i = hashPos(h, key);
+    while (h->val[i] != SLOT_NONE) {
+        if (h->key[i] == key) return h->val[i];
+        i = (i + 1) & (h->size - 1);
+    }
+    return SLOT_NONE;
+}
+
+static void hashPut(HASH_T *h, uint32_t key, uint16_t val) {
+    uint32_t i;
+    HASH_T g;
+
+    if (2 * (h->used + 1) > h->size && hashInit(&g, 2 * h->size) == 0) {
+        for (i=0; i<h->size; i++)
+            if (h->val[i] != SLOT_NONE) hashPut(&g, h->key[i], h->val[i]);
+        free(h->key);
+        free(h->val);
+        *h = g;
+    }
+    if (h->used + 1 >= h->size) return;
+    i = hashPos(h, key);
+    while (h->val[i] != SLOT_NONE && h->key[i] != key) i = (i + 1) & (h->size - 1);
+    if (h->val[i] == SLOT_NONE) h->used++;
+    h->key[i] = key;
+    h->val[i] = val;
+}
+
+// backward shift: entries behind the gap move up when their probe
+// sequence passes the gap, so lookups need no tombstones
+static void hashDel(HASH_T *h, uint32_t key) {
+    uint32_t i = hashPos(h, key), j, m = h->size - 1;
+
+    while (h->val[i] != SLOT_NONE && h->key[i] != key) i = (i + 1) & m;
+    if (h->val[i] == SLOT_NONE) return;
+    for (j = (i + 1) & m; h->val[j] != SLOT_NONE; j = (j + 1) & m) {
+        if (((j - hashPos(h, h->key[j])) & m) >= ((j - i) & m)) {
+            h->key[i] = h->key[j];
+            h->val[i] = h->val[j];
+            i = j;
+        }
+    }
+    h->val[i] = SLOT_NONE;
+    h->used--;
+}
+
+// ######################################################################
+
+// empty table of the next generation, arrays in the same allocation
+static NODETAB_T *newTable(uint16_t cnt) {
+    NODETAB_T *t;
+
+    t = malloc(sizeof(NODETAB_T) + cnt * (sizeof(struct sockaddr_in) + sizeof(uint16_t)));
+    if (!t) {
+        perror("node table");
+        return NULL;
+    }
+    t->gen = current ? current->gen + 1 : 0;
+    t->cnt = 0;
+    t->addr = (struct sockaddr_in*)(t + 1);
+    t->slot = (uint16_t*)(t->addr + cnt);
+    t->next = NULL;
+    return t;
+}
+
+static void addEntry(NODETAB_T *t, uint16_t s, uint32_t ip) {
+    memset(t->addr + t->cnt, 0, sizeof(struct sockaddr_in));
+    t->addr[t->cnt].sin_family = AF_INET;
+    t->addr[t->cnt].sin_port = htons(nodePort);
+    t->addr[t->cnt].sin_addr.s_addr = ip;
+    t->slot[t->cnt++] = s;
+}
+
+// free the retired tables without pin, and the slots that are in none
+// of the pinned tables
+static void reclaim(void) {
+    NODETAB_T **r, *o;
+    uint32_t min;
+    uint16_t i, k;
+
+    pthread_mutex_lock(&regMutex);
+    min = current->gen;
+    for (i=0; i<PIN_NR; i++) if (pins[i] && pins[i]->gen < min) min = pins[i]->gen;
+    for (r = &retired; (o = *r); ) {
+        for (i=0; i<PIN_NR && pins[i] != o; i++);
+        if (i < PIN_NR) r = &o->next;
+        else {
+            *r = o->next;
+            free(o);
+        }
+    }
+    pthread_mutex_unlock(&regMutex);
+    for (i=k=0; i<limboCnt; i++) {
+        if (gone[limbo[i]] <= min) freeSlots[freeCnt++] = limbo[i];
+        else limbo[k++] = limbo[i];
+    }
+    limboCnt = k;
+}
+
+// make t the current table, readers pin it from the next frame on
+static void publish(NODETAB_T *t) {
+    pthread_mutex_lock(&regMutex);
+    current->next = retired;
+    retired = current;
+    current = t;
+    nodecnt = t->cnt;
+    pthread_mutex_unlock(&regMutex);
+    reclaim();
+}
+
+// slot leaves with table generation gen, address at ix of the current table
+static void dropSlot(uint16_t s, uint16_t ix, uint32_t gen) {
+    hashDel(&byIp, current->addr[ix].sin_addr.s_addr);
+    if (hashGet(&byId, ctrids[s]) == s) hashDel(&byId, ctrids[s]);
+    nodes[s].ip = 0;
+    gone[s] = gen;
+    limbo[limboCnt++] = s;
+}
+
+// ######################################################################
+
+// max node slots, the packet buffers are assigned to slots by the caller
+int initRegistry(uint16_t max, uint16_t port) {
+    uint16_t i;
+
+    nodeMax = max;
+    nodePort = port;
+    nodes = calloc(max, sizeof(NODE_T));
+    ctrids = calloc(max, sizeof(uint32_t));
+    seen = calloc(max, sizeof(uint32_t));
+    gone = calloc(max, sizeof(uint32_t));
+    freeSlots = malloc(max * sizeof(uint16_t));
+    limbo = malloc(max * sizeof(uint16_t));
+    if (!nodes || !ctrids || !seen || !gone || !freeSlots || !limbo
+        || hashInit(&byIp, HASH_MIN) < 0 || hashInit(&byId, HASH_MIN) < 0
+        || !(current = newTable(0))) {
+        perror("node registry");
+        return -1;
+    }
+    // lowest slot first
+    for (i=0; i<max; i++) freeSlots[i] = max - 1 - i;
+    freeCnt = max;
+    return 0;
+}
+
+// alive packet of controller ctrid from ip: register a new node, or
+// follow a node to its new address, returns the slot or -1 when full
+int nodeAlive(struct in_addr ip, uint32_t ctrid, int *added) {
+    uint16_t s, i;
+    uint32_t now = nowMs();
+    char old[INET_ADDRSTRLEN] = "";
+    NODETAB_T *t;
+    NODE_T *node;
+
+    *added = 0;
+    s = hashGet(&byIp, ip.s_addr);
+    if (s != SLOT_NONE) {
+        seen[s] = now;
+        // id changed by the editor or on the node itself
+        if (ctrids[s] != ctrid) {
+            if (hashGet(&byId, ctrids[s]) == s) hashDel(&byId, ctrids[s]);
+            hashPut(&byId, ctrid, s);
+            ctrids[s] = ctrid;
+            nodes[s].id = ctrid >> 16;
+            nodes[s].mapping = ctrid & 0xffff;
+        }
+        return s;
+    }
+    s = hashGet(&byId, ctrid);
+    if (s != SLOT_NONE && now - seen[s] >= REKEY_MS) {
+        if (!(t = newTable(current->cnt))) return -1;
+        for (i=0; i<current->cnt; i++) {
+            if (current->slot[i] != s) addEntry(t, current->slot[i], current->addr[i].sin_addr.s_addr);
+            else {
+                inet_ntop(AF_INET, &current->addr[i].sin_addr, old, sizeof(old));
+                hashDel(&byIp, current->addr[i].sin_addr.s_addr);
+                addEntry(t, s, ip.s_addr);
+            }
+        }
+        printf("Node moved: %08x %s => %s\n", ctrid, old, inet_ntoa(ip));
+        hashPut(&byIp, ip.s_addr, s);
+        nodes[s].ip = ip.s_addr;
+        seen[s] = now;
+        publish(t);
+        return s;
+    }
+    if (!freeCnt) {
+        printf("node list full\n");
+        return -1;
+    }
+    if (!(t = newTable(current->cnt + 1))) return -1;
+    s = freeSlots[--freeCnt];
+    node = nodes + s;
+    printf("New node: %08x <= %s\n", ctrid, inet_ntoa(ip));
+    node->id = ctrid >> 16;
+    node->len = 3*LED_CNT+2; // 3 byte LED_CNT pixel + header
+    node->mapping = ctrid & 0xffff;
+    node->cnt = 0;
+    memset(node->rcnt, 0, sizeof(node->rcnt));
+    // nothing of the node that had the slot before: frame numbers from
+    // the start, a keyframe first (no reference) and a new canvas map
+    node->seq = 0;
+    memset(node->refCmd, 0, sizeof(node->refCmd));
+    free(node->cmap);
+    node->cmap = NULL;
+    node->ip = ip.s_addr;
+    ctrids[s] = ctrid;
+    seen[s] = now;
+    hashPut(&byIp, ip.s_addr, s);
+    hashPut(&byId, ctrid, s);
+    for (i=0; i<current->cnt; i++) addEntry(t, current->slot[i], current->addr[i].sin_addr.s_addr);
+    addEntry(t, s, ip.s_addr);
+    publish(t);
+    *added = 1;
+    return s;
+}
+
+// remove nodes without alive packet for ms (0 = never), called
+// periodically by the writer, also to reuse what was unpinned since
+void nodeExpire(uint32_t ms) {
+    uint16_t i, s, n = 0;
+    uint32_t now = nowMs();
+    struct in_addr ia;
+    NODETAB_T *t;
+
+    for (i=0; ms && i<current->cnt; i++)
+        if (now - seen[current->slot[i]] >= ms) n++;
+    if (n && (t = newTable(current->cnt - n))) {
+        for (i=0; i<current->cnt; i++) {
+            s = current->slot[i];
+            if (now - seen[s] < ms) {
+                addEntry(t, s, current->addr[i].sin_addr.s_addr);
+                continue;
+            }
+            ia = current->addr[i].sin_addr;
+            printf("Node expired: %08x %s\n", ctrids[s], inet_ntoa(ia));
+            dropSlot(s, i, t->gen);
+        }
+        publish(t);
+    } else reclaim();
+}
+
+// pin the current table, kept until the pin is set again
+NODETAB_T *nodePin(uint16_t pin) {
+    NODETAB_T *t;
+    pthread_mutex_lock(&regMutex);
+    t = pins[pin] = current;
+    pthread_mutex_unlock(&regMutex);
+    return t;
+}
+
+NODETAB_T *nodePinned(uint16_t pin) {
+    NODETAB_T *t;
+    pthread_mutex_lock(&regMutex);
+    t = pins[pin];
+    pthread_mutex_unlock(&regMutex);
+    return t;
+}
+
+void nodeUnpin(uint16_t pin) {
+    pthread_mutex_lock(&regMutex);
+    pins[pin] = NULL;
+    pthread_mutex_unlock(&regMutex);
+}
+
+// eof
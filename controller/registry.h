@@ -0,0 +1,34 @@
+// registry.c provides:
+// node registry: node slots allocated at start, looked up by address
+// and controller id, expired when silent. The frame loop works on
+// immutable node tables, a new table is published on every change.
+
+// pins: one per frame ring slot, the tables its packets were rendered
+// with, one for the editor and one for the statistics endpoint
+#define PIN_EDIT FRAME_RING
+#define PIN_STATS (FRAME_RING+1)
+#define PIN_NR (FRAME_RING+2)
+// unused slot or hash entry
+#define SLOT_NONE 0xffff
+
+// table of active nodes: slot index and destination address
+typedef struct NODETAB {
+    uint32_t gen;
+    uint16_t cnt;
+    uint16_t *slot;
+    struct sockaddr_in *addr;
+    struct NODETAB *next;
+} NODETAB_T;
+
+extern NODE_T *nodes;
+extern uint16_t nodeMax;
+extern volatile uint16_t nodecnt;
+
+int initRegistry(uint16_t max, uint16_t port);
+int nodeAlive(struct in_addr ip, uint32_t ctrid, int *added);
+void nodeExpire(uint32_t ms);
+NODETAB_T *nodePin(uint16_t pin);
+NODETAB_T *nodePinned(uint16_t pin);
+void nodeUnpin(uint16_t pin);
+
+// eof
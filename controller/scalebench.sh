@@ -0,0 +1,53 @@
+#!/bin/sh
+# sender throughput against the number of nodes, on loopback
+# for each scale point, nodeemu emulates the nodes, which register with
+# the sender through their alive packets, then the sender measures in
+# benchmark mode (-b) with the pattern of -t in SENDER_OPTS (default 2,
+# trains). One table row per scale point:
+#   nodes       registered nodes at the end of the run
+#   fps         frames sent per second
+#   cpu_us      sender CPU time per frame (all threads, user + system)
+#   p50/p99_us  frame completion: deadline to the last packet sent, the
+#               pacing window included (-T 0 sends bursts)
+#   calls       transmit syscalls per frame
+#   pkts        packets (datagrams) per frame
+#   rx_fps      frames received per node and second by the emulator
+#   late        deadlines without a new frame from the render stage
+#   pattern     the pattern measured
+#
+# usage: scalebench.sh [seconds] [node counts...]
+# default: 10 seconds at 1 10 100 1000 nodes; more sender options, like
+# -u, -d 30 or -t 1, can be given in SENDER_OPTS
+
+cd "$(dirname "$0")" || exit 1
+SEC=${1:-10}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-1 10 100 1000}
+TMP=${TMPDIR:-/tmp}/scalebench.$$
+
+# a socket per emulated node
+ulimit -n 8192 2>/dev/null
+
+printf "%6s %6s %6s %8s %8s %8s %6s %6s %6s %6s  %s\n" \
+    want nodes fps cpu_us p50_us p99_us calls pkts rx_fps late pattern
+for n in $COUNTS; do
+    max=256
+    [ "$n" -gt $max ] && max=$n
+    ./nodeemu -n "$n" -r 1 -t $((SEC + 6)) > "$TMP.emu" 2>&1 &
+    emu=$!
+    ./sender -b "$SEC" -n "$max" $SENDER_OPTS < /dev/null > "$TMP.snd" 2>&1
+    kill "$emu" 2>/dev/null
+    wait "$emu" 2>/dev/null
+    # median of the receive rates while all nodes were streaming
+    rx=$(awk -v n="$n" '$2 == n && $3 == n && $4 > 0 { print $4 }' "$TMP.emu" |
+        sort -n | awk '{ v[NR] = $1 } END { print NR ? v[int((NR+1)/2)] : "-" }')
+    awk -v want="$n" -v rx="$rx" '$1 == "bench" {
+        for (i = 2; i < NF; i += 2) v[$i] = $(i+1)
+        printf "%6s %6s %6s %8s %8s %8s %6s %6s %6s %6s  %s\n", want, v["nodes"],
+            v["fps"], v["cpu_us_frame"], v["done_p50"], v["done_p99"],
+            v["syscalls_frame"], v["pkts_frame"], rx, v["late"], v["pattern"]
+        found = 1
+    }
+    END { if (!found) printf "%6s  sender failed\n", want }' "$TMP.snd"
+done
+rm -f "$TMP.emu" "$TMP.snd"
@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -12,165 +13,864 @@
 #include <termios.h>
 #include <time.h> 
 #include <pthread.h>
-#include <stdatomic.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <math.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
 
 #include "adafruit.h"
 #include "patterns.h"
+#include "txuring.h"
+#include "histo.h"
+#include "canvas.h"
+#include "encode.h"
+#include "registry.h"
+#include "record.h"
 
 volatile int running = 1;
 #define PKTLEN 1472
 #define PORT 5700
 
-in_addr_t nodeip[NODE_NR];
 uint16_t cfgBrightness = 3, cfgPattern = 2;
 
-volatile uint16_t frame, nodecnt = 0;
-NODE_T *nodes;
-pthread_cond_t sendSig, syncSig, pixelSig;
-atomic_int nodeReady = ATOMIC_VAR_INIT(0);
+volatile uint16_t frame;
+pthread_cond_t sendSig, renderSig, pixelSig;
+pthread_mutex_t sendMutex = PTHREAD_MUTEX_INITIALIZER;
+uint16_t sendReq = 0;
+
+// frame ring, protected by sendMutex: the slot indices are a permutation
+// of 0..FRAME_RING-1; ringFresh is set when ringReady holds a complete
+// frame that has not been sent yet. Each ring slot pins the node table
+// it was rendered with.
+uint8_t ringDraw = 0, ringReady = 1, ringSend = 2, ringFresh = 0;
+uint16_t ringFrame[FRAME_RING];
 
 #define SOCKLEN sizeof(struct sockaddr_in)
+// max nodes, packets per frame: 4 channels per node
+#define NODE_LIMIT 4096
+#define TX_MAX (nodeMax*4)
+
+// shared unconnected socket for pixel data and time beacons
+int txfd;
+struct sockaddr_in bcaddr;
+struct mmsghdr *txmsg;
+// three entries per packet: header, pixel data and the presentation time showTs,
+// which the nodes show the frame at, in the clock of the time beacons;
+// showLead: presentation time after the send deadline in us
+struct iovec *txiov;
+uint8_t showTs[PTS_LEN];
+long showLead = 0;
+// control data per message: UDP_SEGMENT, then the kernel pacing cmsgs
+#define TXCTL_LEN (CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t)) \
+                 + CMSG_SPACE(sizeof(uint32_t)))
+uint8_t *txctl;
+// UDP GSO (-G off): the packets of a node go in one message when they
+// have the same length (the last one may be shorter), the kernel cuts it
+// into datagrams of packet and presentation time; datagrams of the last
+// frame beyond one per message
+int gso = 1;
+uint16_t gsoExtra;
+// GSO failed at send time, the frame goes again without it
+int gsoRetry;
+// pacing: the packets of a frame leave in slots spread over paceUs after
+// the deadline (-1 = half the show lead, 0 = one burst), slots at least
+// PACE_SLOT_US apart, the packets of a node in one slot
+#define PACE_SLOT_US 250
+long paceUs = -1;
+uint16_t paceSlots;
+// kernel pacing (-K): each message carries its departure time as
+// SCM_TXTIME and asks for a software transmit timestamp, matched by key
+// to the scheduled time; txtime 1 = requested, 2 = active. Departure
+// times are on the monotonic clock for fq, on CLOCK_TAI for the ETF qdisc
+// (switched to when it rejects them), at least TXTIME_MARGIN_US ahead
+#define TXTIME_EARLY_US 100
+#define TXTIME_MARGIN_US 200
+typedef struct {
+    uint64_t ns;
+    uint32_t key;
+} TXSTAMP_T;
+int txtime = 0;
+clockid_t txClock = CLOCK_MONOTONIC;
+TXSTAMP_T *txStamp;
+uint32_t txKey;
+// departures that missed their time, timestamps without a scheduled time
+volatile uint32_t txtimeDrops, txtimeMiss;
+// multicast mode: group address, slice tables and the gather list of
+// the datagrams, the packets stay in the ring slot
+int mcast = 0;
+struct sockaddr_in mcaddr;
+uint8_t *mchdr;
+struct iovec *mciov;
+// one arena for all node packet buffers and the shared pixel data of
+// each ring slot behind them
+uint8_t *pktbuf, *sharebuf;
+int txring = 0;
+// transmit statistics of the last frame, and worst case send time
+volatile uint32_t txPkts, txCalls, txErrs, txUsec, txUsecMax;
+// totals since the last reset: frames sent, syscalls and packets
+volatile uint32_t txFrames;
+volatile uint64_t txCallSum, txPktSum;
+// pixel data bytes of the last frame, encoded and as full packets
+volatile uint32_t txBytes, txRaw;
+
+// receive statistics reported by the nodes, rates since the last report,
+// late: frames that arrived after their presentation time;
+// transmit: deadline until the node's packets were sent in the last
+// frame and at worst, failed sends;
+// rate control: target rate and the frame clock divisor it asks for,
+// published atomically; the divisor in use (0 = every frame) and the
+// next frame the node gets belong to renderLoop
+typedef struct {
+    uint32_t pkts, frames, lost, dup, reorder, late, reports;
+    struct timespec ts;
+    float fps, loss, latePct;
+    uint32_t txUs, txUsMax, txErrs;
+    float rate;
+    uint8_t rateDiv, div;
+    uint16_t next;
+} NODESTAT_T;
+NODESTAT_T *nstat;
+// node slot of each message, SLOT_NONE for multicast and playback,
+// result of each message with io_uring
+uint16_t *txSlot;
+int32_t *txRes;
+// seconds without alive packet until a node is removed, 0 = never
+uint16_t expireSec = 10;
+// per node rates: AIMD on loss and late frames in percent, a node gets
+// at least every RATE_DIV_MAX-th frame; the slots due in a frame
+#define RATE_DIV_MAX 8
+#define RATE_STEP 1.0
+#define LOSS_HI 5.0
+#define LOSS_LO 1.0
+#define LATE_HI 5.0
+#define LATE_LO 1.0
+int adaptive = 1;
+uint16_t *dueSlot;
+
+// frame clock: frames per second, real-time mode (-2 off, -1 no pinning)
+#define RT_PRIO 50
+// seconds for the nodes to register before a benchmark run
+#define BENCH_WARMUP 3
+uint16_t fps = 30;
+int rtCpu = -2;
+// render worker threads, including the render stage itself
+uint16_t workerCnt;
+// wake-up lateness, frame period error and render time,
+// frames dropped from schedule and deadlines without a new frame
+HIST_T hLate, hPeriod, hRender;
+volatile uint32_t overruns, lateFrames;
+// frame completion: deadline to the last message sent
+HIST_T hDone;
+struct timespec sendDeadline;
+// playback: the recorded frame due at sendDeadline
+uint32_t sendPlay;
+// render time per pattern, encoding time of a frame (all workers),
+// send time of a frame, deadline until a node's packets were sent
+HIST_T hPat[PAT_NR+1], hEncode, hTx, hNodeTx;
+// kernel pacing: actual against scheduled departure, either direction
+HIST_T hDepart;
+// time beacons for the node clocks, the last one was due at beaconTs
+#define BEACON_US 250000
+struct timespec beaconTs;
+// plain text statistics on a UNIX socket, NULL = off
+char *statsPath = NULL;
+// recording written with the W command, playback instead of rendering
+char *recPath = "sender.rec";
+int playing = 0;
 
 // ######################################################################
 
-void add_ms(struct timespec *time, long milliseconds) {
-    time->tv_nsec += milliseconds * 1000000L;
-    if (time->tv_nsec >= 1000000000L) {
+void add_ns(struct timespec *time, long ns) {
+    time->tv_nsec += ns;
+    while (time->tv_nsec >= 1000000000L) {
         time->tv_sec += 1;
         time->tv_nsec -= 1000000000L;
     }
 }
-// compute pixel patterns over all strips
-void* pixelLoop(void* arg) {
-    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-    pthread_mutex_t mutex;
-    uint16_t c;
-    struct timespec target_time;
+
+long diff_us(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+// real-time mode: FIFO scheduling and CPU pinning for the calling thread
+void setRealtime(int prio) {
+    struct sched_param sp;
+    cpu_set_t cpus;
+
+    sp.sched_priority = prio;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+        printf("SCHED_FIFO not permitted\n");
+    if (rtCpu < 0) return;
+    CPU_ZERO(&cpus);
+    CPU_SET(rtCpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        printf("CPU pinning failed\n");
+}
+
+// render stage: draws the next frame into the free ring slot, at most
+// one frame ahead of the transmit stage, so a pattern can use the full
+// frame period without the sender ever seeing a half-written packet
+void* renderLoop(void* arg) {
+    uint16_t i, n, p;
+    uint8_t d, t, div;
+    long us;
+    NODE_T *node;
+    NODESTAT_T *ns;
+    NODETAB_T *tab;
+    struct timespec t0, t1;
 
     frame = 0;
-	pthread_mutex_init (&mutex, NULL);
-    pthread_mutex_lock (&mutex);
+    initPool(workerCnt);
+    pthread_mutex_lock (&sendMutex);
     while (running) {
-        clock_gettime(CLOCK_REALTIME, &target_time);
-        add_ms (&target_time, 33);
-        c = nodecnt;
-        createPkt(nodes, frame);
-        frame++;
-        while (pthread_cond_timedwait(&cond, &mutex, &target_time) == EINTR);
-        // set node counter
-        if (c) {
-            atomic_store(&nodeReady, c);
-            pthread_cond_broadcast (&sendSig);
+        while (ringFresh && running) pthread_cond_wait (&renderSig, &sendMutex);
+        d = ringDraw;
+        pthread_mutex_unlock (&sendMutex);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        // nodes registered or removed meanwhile take effect with this frame
+        tab = nodePin(d);
+        for (i=0, n=0; i<tab->cnt; i++) {
+            node = nodes + tab->slot[i];
+            node->pkt = node->ring + d*NODE_BUF;
+            node->cnt = 0;
+            // a node at a lower rate gets every div-th frame only
+            ns = nstat + tab->slot[i];
+            div = __atomic_load_n(&ns->rateDiv, __ATOMIC_RELAXED);
+            if (div != ns->div) {
+                ns->next = frame + (div ? tab->slot[i] % div : 0);
+                ns->div = div;
+            }
+            if (ns->div && (int16_t)(frame - ns->next) < 0) continue;
+            ns->next = frame + (ns->div ? ns->div : 1);
+            dueSlot[n++] = tab->slot[i];
         }
+        // a recording starts with a keyframe, so it can be looped
+        if (recKeyframe())
+            for (i=0; i<tab->cnt; i++) memset(nodes[tab->slot[i]].refCmd, 0, sizeof(nodes->refCmd));
+        p = patternType();
+        createPkt(nodes, dueSlot, n, frame, sharebuf + d*SHARE_BUF);
+        for (i=0; i<tab->cnt; i++) {
+            node = nodes + tab->slot[i];
+            node->rcnt[d] = node->cnt;
+            memcpy(node->rlen[d], node->plen, sizeof(node->plen));
+            memcpy(node->rpay[d], node->pay, sizeof(node->pay));
+        }
+        ringFrame[d] = frame;
+        recFrame(d, frame++);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        us = diff_us(&t0, &t1);
+        histAdd(&hRender, us);
+        if (p <= PAT_NR) histAdd(hPat + p, us);
+        histAdd(&hEncode, encodeUsec());
+        pthread_mutex_lock (&sendMutex);
+        t = ringReady; ringReady = ringDraw; ringDraw = t;
+        ringFresh = 1;
     }
+    pthread_mutex_unlock (&sendMutex);
+    exitPool();
     return NULL;
 }
 
-// one thread for each node, send pixel data to it
-void* sendLoop(void* arg) {
-    uint16_t l;
-    uint8_t *p;
-    NODE_T *node = (NODE_T*) arg;
-    pthread_mutex_t mutex;
-
-	pthread_mutex_init (&mutex, NULL);
-    pthread_mutex_lock (&mutex);
+// frame clock: absolute deadlines on the monotonic clock, so render time
+// does not add up as drift. Frames that are late by more than a period
+// are dropped from the schedule instead of being sent in a burst.
+// Playback follows the recorded frame times.
+void* clockLoop(void* arg) {
+    long late, err, period = 1000000L / fps;
+    struct timespec next, now, prev;
+    uint32_t pos = 0;
 
+    if (rtCpu != -2) setRealtime(RT_PRIO);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    prev = next;
     while (running) {
-        pthread_cond_wait (&sendSig, &mutex);
-        p = node->pkt;
-        l = node->len;
-        while (node->cnt--) {
-            send(node->fd, p, l, 0);
-            p += l;
+        add_ns (&next, period * 1000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = diff_us(&next, &now);
+        err = diff_us(&prev, &now) - period;
+        prev = now;
+        histAdd(&hLate, late);
+        histAdd(&hPeriod, err < 0 ? -err : err);
+        if (late > period) {
+            next = now;
+            overruns++;
+        }
+        // hand the deadline over to the transmit stage
+        if (nodecnt || playing) {
+            pthread_mutex_lock (&sendMutex);
+            sendReq = 1;
+            sendDeadline = next;
+            sendPlay = pos;
+            pthread_cond_signal (&sendSig);
+            pthread_mutex_unlock (&sendMutex);
         }
-        // when all sent, sync and start next drawing cycle
-        if (atomic_fetch_sub(&nodeReady, 1) == 1) pthread_cond_signal (&syncSig);
+        if (playing) pos = playNext(pos, &period);
     }
-    close(node->fd);
     return NULL;
 }
 
-// broadcast UDP sync signal to all nodes
-void* syncLoop(void* arg) {
-    int fd;
-	int l, on = 1;
-    struct sockaddr_in addr;
-    char buffer[32];
-    pthread_mutex_t mutex;
+// append a control message to message n, returns its data
+void *txCmsg(uint16_t n, int level, int type, size_t len) {
+    struct msghdr *mh = &txmsg[n].msg_hdr;
+    struct cmsghdr *c;
+
+    mh->msg_control = txctl + (size_t)n * TXCTL_LEN;
+    c = (struct cmsghdr*)((uint8_t*)mh->msg_control + mh->msg_controllen);
+    c->cmsg_level = level;
+    c->cmsg_type = type;
+    c->cmsg_len = CMSG_LEN(len);
+    mh->msg_controllen += CMSG_SPACE(len);
+    return CMSG_DATA(c);
+}
+
+// segments of the GSO message for the c packets of a node in ring slot
+// s, 1 when they go one by one
+static uint16_t gsoSegs(NODE_T *node, uint8_t s, uint16_t c) {
+    uint16_t k;
+
+    if (!gso || c < 2) return 1;
+    for (k=1; k<c; k++) {
+        if (node->rlen[s][k] > node->rlen[s][0]) return 1;
+        if (k < c-1 && node->rlen[s][k] != node->rlen[s][0]) return 1;
+    }
+    return c;
+}
+
+// collect the packets of the nodes the ring slot was rendered for into
+// one message vector, a node's packets in one message with GSO, returns
+// number of messages
+uint16_t collectPkts(uint8_t s) {
+    uint16_t i, k, c, seg, n = 0, v = 0;
+    uint32_t bytes = 0, raw = 0;
+    uint8_t *p;
+    NODE_T *node;
+    struct msghdr *mh = NULL;
+    NODETAB_T *tab = nodePinned(s);
+
+    for (i=0; tab && i<tab->cnt; i++) {
+        node = nodes + tab->slot[i];
+        p = node->ring + s*NODE_BUF;
+        c = node->rcnt[s] < 4 ? node->rcnt[s] : 4;
+        seg = gsoSegs(node, s, c);
+        for (k=0; k<c; k++) {
+            if (k % seg == 0) {
+                mh = &txmsg[n].msg_hdr;
+                mh->msg_name = tab->addr+i;
+                mh->msg_iov = txiov + v;
+                mh->msg_iovlen = 0;
+                mh->msg_controllen = 0;
+                txSlot[n++] = tab->slot[i];
+            }
+            // header and pixel data, which may be shared
+            txiov[v].iov_base = p;
+            txiov[v].iov_len = 2;
+            txiov[v+1].iov_base = node->rpay[s][k];
+            txiov[v+1].iov_len = node->rlen[s][k] - 2;
+            txiov[v+2].iov_base = showTs;
+            txiov[v+2].iov_len = PTS_LEN;
+            v += 3;
+            mh->msg_iovlen += 3;
+            bytes += node->rlen[s][k];
+            raw += node->len;
+            p += node->len;
+        }
+        if (seg > 1) {
+            k = node->rlen[s][0] + PTS_LEN;
+            memcpy(txCmsg(n-1, SOL_UDP, UDP_SEGMENT, sizeof(uint16_t)), &k, sizeof(uint16_t));
+            gsoExtra += seg - 1;
+        }
+    }
+    txBytes = bytes;
+    txRaw = raw;
+    return n;
+}
+
+// complete the datagram of the cnt slices in h, its gather list at iov
+static uint8_t *mcSeal(uint8_t *h, uint16_t cnt, uint16_t frame,
+                       struct iovec *iov, uint16_t n) {
+    uint16_t j, off, hl = MC_HDR + MC_SLICE*cnt;
+    uint8_t *e = h + MC_HDR;
+
+    h[0] = 'm';
+    h[1] = frame;
+    h[2] = cnt;
+    for (j=0, off=hl; j<cnt; j++, e += MC_SLICE) {
+        e[2] = off & 0xff;
+        e[3] = off >> 8;
+        off += e[4] | (e[5] << 8);
+    }
+    iov->iov_base = h;
+    iov->iov_len = hl;
+    txmsg[n].msg_hdr.msg_name = &mcaddr;
+    txmsg[n].msg_hdr.msg_iov = iov;
+    txmsg[n].msg_hdr.msg_iovlen = 3*cnt + 1;
+    txmsg[n].msg_hdr.msg_controllen = 0;
+    txSlot[n] = SLOT_NONE;
+    return h + hl;
+}
+
+// multicast: the packets of all nodes packed into as few datagrams as
+// fit in PKTLEN, each led by its slice table; a slice is the packet
+// (header and pixel data) and the presentation time
+uint16_t collectMcast(uint8_t s) {
+    uint16_t i, k, n = 0, cnt = 0, len, size = 0;
+    uint32_t bytes = 0, raw = 0, v = 0, hv = 0;
+    uint8_t *h = mchdr, *p, *e;
+    NODE_T *node;
+    NODETAB_T *tab = nodePinned(s);
+
+    for (i=0; tab && i<tab->cnt; i++) {
+        node = nodes + tab->slot[i];
+        p = node->ring + s*NODE_BUF;
+        for (k=0; k < node->rcnt[s] && k < 4; k++, p += node->len) {
+            len = node->rlen[s][k] + PTS_LEN;
+            if (cnt && (cnt == MC_SLICE_MAX || size + MC_SLICE + len > PKTLEN)) {
+                h = mcSeal(h, cnt, ringFrame[s], mciov + hv, n++);
+                cnt = 0;
+            }
+            // the slice table goes in front, its gather entry first
+            if (!cnt) {
+                hv = v++;
+                size = MC_HDR;
+            }
+            e = h + MC_HDR + MC_SLICE*cnt;
+            e[0] = node->id & 0xff;
+            e[1] = node->id >> 8;
+            e[4] = len & 0xff;
+            e[5] = len >> 8;
+            mciov[v].iov_base = p;
+            mciov[v].iov_len = 2;
+            v++;
+            mciov[v].iov_base = node->rpay[s][k];
+            mciov[v].iov_len = node->rlen[s][k] - 2;
+            v++;
+            mciov[v].iov_base = showTs;
+            mciov[v].iov_len = PTS_LEN;
+            v++;
+            cnt++;
+            size += MC_SLICE + len;
+            bytes += node->rlen[s][k];
+            raw += node->len;
+        }
+    }
+    if (cnt) mcSeal(h, cnt, ringFrame[s], mciov + hv, n++);
+    txBytes = bytes;
+    txRaw = raw;
+    return n;
+}
+
+// playback of recorded frame pos: the message vector points into the
+// mapped recording
+uint16_t collectPlay(uint32_t pos) {
+    uint16_t i, n, f;
+    uint32_t bytes, raw;
 
+    // a recorded packet and the presentation time per message
+    n = playPkts(txmsg, txiov, pos, &f, &bytes, &raw);
+    for (i=0; i<n; i++) {
+        txmsg[i].msg_hdr.msg_iov = txiov + 2*i;
+        txmsg[i].msg_hdr.msg_iovlen = 2;
+        txiov[2*i+1].iov_base = showTs;
+        txiov[2*i+1].iov_len = PTS_LEN;
+        txSlot[i] = SLOT_NONE;
+        txmsg[i].msg_hdr.msg_controllen = 0;
+    }
+    txBytes = bytes;
+    txRaw = raw;
+    return n;
+}
+
+// broadcast the sender clock as time beacon "t<usec>", low 32 bit in hex,
+// stamped right before it is sent; the nodes synchronize their clocks
+// to the least delayed beacons
+void sendBeacon(void) {
+    struct timespec t;
+    char buf[16];
+    int len;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    len = snprintf(buf, sizeof(buf), "t%08x",
+        (uint32_t)(t.tv_sec * 1000000ull + t.tv_nsec / 1000));
+    sendto(txfd, buf, len, 0, (struct sockaddr*)&bcaddr, SOCKLEN);
+}
+
+// presentation time of the frame sent at deadline dl
+void setShowTs(struct timespec *dl) {
+    uint32_t us = dl->tv_sec * 1000000ull + dl->tv_nsec / 1000 + showLead;
+
+    showTs[0] = us & 0xff;
+    showTs[1] = us >> 8;
+    showTs[2] = us >> 16;
+    showTs[3] = us >> 24;
+}
+
+// messages from..to-1 were sent us after the deadline
+void nodeTx(uint16_t from, uint16_t to, long us, int err) {
+    NODESTAT_T *ns;
+
+    for (; from < to; from++) {
+        if (txSlot[from] == SLOT_NONE) continue;
+        ns = nstat + txSlot[from];
+        ns->txUs = us;
+        if (us > ns->txUsMax) ns->txUsMax = us;
+        if (err) ns->txErrs++;
+        histAdd(&hNodeTx, us);
+    }
+}
+
+// a failed GSO message (more than one packet): kernels before 6.2 fail
+// them with EIO on a route whose device lacks transmit checksum offload,
+// like many WiFi cards, and EINVAL when segmentation is not possible;
+// GSO is off from then on
+static void gsoFail(uint16_t i, int err) {
+    if (!gso || (err != EIO && err != EINVAL)) return;
+    if (txSlot[i] == SLOT_NONE || txmsg[i].msg_hdr.msg_iovlen <= 3) return;
+    printf("UDP GSO failed (%s), a message per packet\n", strerror(err));
+    gso = 0;
+    gsoRetry = 1;
+}
+
+// send messages from..to-1 with sendmmsg or io_uring, in order
+void txSend(uint16_t from, uint16_t to, uint32_t *calls, uint32_t *errs, struct timespec *dl) {
+    uint16_t i, done = from;
+    struct timespec t;
+    int r, e;
+
+    if (txring) {
+        uringSend(txfd, txmsg + from, to - from, calls, errs, txRes + from);
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        // io_uring: all completions are in when the batch returns
+        for (i=from; i<to; i++) {
+            nodeTx(i, i+1, diff_us(dl, &t), txRes[i] < 0);
+            if (txRes[i] < 0) gsoFail(i, -txRes[i]);
+        }
+        return;
+    }
+    while (done < to) {
+        r = sendmmsg(txfd, txmsg+done, to-done, 0);
+        (*calls)++;
+        // skip a failing packet, nodes will reconnect
+        e = r < 0;
+        if (e) {
+            gsoFail(done, errno);
+            (*errs)++;
+            r = 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        nodeTx(done, done + r, diff_us(dl, &t), e);
+        done += r;
+    }
+}
+
+// departure time ns (monotonic, off to the socket's clock) and a
+// timestamp request for messages from..to-1
+void txtimeStamp(uint16_t from, uint16_t to, uint64_t ns, int64_t off) {
+    uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+    uint64_t tx = ns + off;
+    TXSTAMP_T *st;
+
+    for (; from < to; from++) {
+        memcpy(txCmsg(from, SOL_SOCKET, SCM_TXTIME, sizeof(uint64_t)), &tx, sizeof(uint64_t));
+        memcpy(txCmsg(from, SOL_SOCKET, SO_TIMESTAMPING, sizeof(uint32_t)), &flags, sizeof(uint32_t));
+        // the kernel counts the timestamped messages of the socket
+        st = txStamp + txKey % (2 * TX_MAX);
+        st->ns = ns;
+        st->key = txKey++;
+    }
+}
+
+// spread the n messages of a frame over the pacing window: slot j of m
+// leaves paceUs*j/m after the deadline, so the access point and the node
+// receive buffers never see the whole frame at once. The window ends
+// before the show time, the packets of the last slot still arrive ahead.
+// With kernel pacing the slots become departure times and the frame goes
+// down in one batch, else the stage sleeps until each slot.
+void paceSend(uint16_t n, uint32_t *calls, uint32_t *errs, struct timespec *dl) {
+    uint16_t j, m, from, to;
+    uint64_t t0 = dl->tv_sec * 1000000000ull + dl->tv_nsec, now;
+    int64_t off = 0;
+    struct timespec t, c;
+
+    // the deadline has passed by now, a qdisc drops packets due before
+    // they are queued: the schedule starts a margin ahead
+    if (txtime == 2) {
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        now = t.tv_sec * 1000000000ull + t.tv_nsec + TXTIME_MARGIN_US * 1000ull;
+        if (t0 < now) t0 = now;
+        if (txClock != CLOCK_MONOTONIC) {
+            clock_gettime(txClock, &c);
+            off = (c.tv_sec - t.tv_sec) * 1000000000ll + (c.tv_nsec - t.tv_nsec);
+        }
+    }
+    m = paceUs / PACE_SLOT_US;
+    if (m > n) m = n;
+    if (m < 1) m = 1;
+    for (j=0, from=0; j<m && from<n; j++) {
+        to = (uint32_t)n * (j+1) / m;
+        // a node's channels go together
+        while (to > from && to < n && txSlot[to] != SLOT_NONE && txSlot[to] == txSlot[to-1]) to++;
+        if (to <= from) continue;
+        if (txtime == 2) txtimeStamp(from, to, t0 + paceUs * 1000ull * j / m, off);
+        else {
+            if (j) {
+                t = *dl;
+                add_ns(&t, paceUs * 1000L * j / m);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+            }
+            txSend(from, to, calls, errs, dl);
+        }
+        from = to;
+    }
+    if (txtime == 2) txSend(0, n, calls, errs, dl);
+    paceSlots = m;
+}
+
+// departure times on clock clk for the transmit socket
+static int txtimeClock(clockid_t clk) {
+    struct sock_txtime st = { clk, SOF_TXTIME_REPORT_ERRORS };
+
+    if (setsockopt(txfd, SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) < 0) return -1;
+    txClock = clk;
+    return 0;
+}
+
+// set up kernel pacing on the transmit socket, departure times on the
+// monotonic clock as the fq qdisc takes them; -1 when the kernel lacks
+// SO_TXTIME or transmit timestamps
+int txtimeInit(void) {
+    uint32_t flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID
+                   | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (txtimeClock(CLOCK_MONOTONIC) < 0 ||
+        setsockopt(txfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        return -1;
+    txStamp = calloc(2 * TX_MAX, sizeof(TXSTAMP_T));
+    if (!txStamp) return -1;
+    txtime = 2;
+    return 0;
+}
+
+// back to user space pacing: a qdisc like ETF drops packets without a
+// departure time once the socket has SO_TXTIME set, which cannot be
+// cleared, so a fresh socket takes over the descriptor
+static void txtimeOff(const char *why) {
+    int fd, on = 1;
+
+    printf("%s, pacing in user space\n", why);
+    txtime = 1;
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Socket creation failed");
-        return NULL;
+        return;
     }
-    if (setsockopt (fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0)
         perror("Broadcast flag failed");
+    if (dup2(fd, txfd) < 0) perror("transmit socket");
+    close(fd);
+}
+
+// departure errors of the packets sent since the last call, from the
+// transmit timestamps on the error queue (realtime clock). Departure
+// times the qdisc rejects switch them to CLOCK_TAI for ETF once. Packets
+// that left early mean the qdisc ignores departure times (no fq, like on
+// loopback), packets it drops mean it cannot meet them, either way
+// pacing goes back to user space.
+void txtimeCheck(void) {
+    char ctl[256];
+    struct msghdr mh;
+    struct cmsghdr *c;
+    struct scm_timestamping *ts;
+    struct sock_extended_err *ee;
+    struct timespec rt, mt;
+    TXSTAMP_T *st;
+    int64_t off, d;
+    uint32_t cnt = 0, early = 0, drops = 0, invalid = 0;
+
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+    off = (rt.tv_sec - mt.tv_sec) * 1000000000ll + (rt.tv_nsec - mt.tv_nsec);
+    for (;;) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = ctl;
+        mh.msg_controllen = sizeof(ctl);
+        if (recvmsg(txfd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+        ts = NULL;
+        ee = NULL;
+        for (c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING)
+                ts = (struct scm_timestamping*)CMSG_DATA(c);
+            else if (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+                ee = (struct sock_extended_err*)CMSG_DATA(c);
+        }
+        if (!ee) continue;
+        // a qdisc dropped the packet: its time had passed or was not on
+        // the qdisc's clock
+        if (ee->ee_origin == SO_EE_ORIGIN_TXTIME) {
+            txtimeDrops++;
+            drops++;
+            if (ee->ee_code == SO_EE_CODE_TXTIME_INVALID_PARAM) invalid++;
+            continue;
+        }
+        if (!ts || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) continue;
+        st = txStamp + ee->ee_data % (2 * TX_MAX);
+        if (st->key != ee->ee_data) {
+            txtimeMiss++;
+            continue;
+        }
+        d = (ts->ts[0].tv_sec * 1000000000ll + ts->ts[0].tv_nsec - off - (int64_t)st->ns) / 1000;
+        histAdd(&hDepart, d < 0 ? -d : d);
+        if (d < -TXTIME_EARLY_US) early++;
+        cnt++;
     }
- 	pthread_mutex_init (&mutex, NULL);
-    pthread_mutex_lock (&mutex);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = INADDR_BROADCAST;
+    if (invalid && txClock == CLOCK_MONOTONIC && txtimeClock(CLOCK_TAI) == 0)
+        printf("qdisc rejects monotonic departure times, using CLOCK_TAI (ETF)\n");
+    else if (drops * 4 > cnt + drops) txtimeOff("qdisc drops departures");
+    else if (paceSlots > 1 && early * 4 > cnt) txtimeOff("qdisc ignores SO_TXTIME");
+}
+
+// transmit stage: at each deadline send the latest complete frame of all
+// nodes, paced over the first part of the period, the nodes show it
+// showLead later
+void* sendLoop(void* arg) {
+    uint16_t n;
+    uint8_t s = 0, t;
+    uint32_t calls, errs, pos;
+    long us;
+    struct timespec t0, t1, dl;
+
+    if (rtCpu != -2) setRealtime(RT_PRIO - 1);
+    for (n=0; n<TX_MAX; n++) txmsg[n].msg_hdr.msg_namelen = SOCKLEN;
+    pthread_mutex_lock (&sendMutex);
     while (running) {
-        pthread_cond_wait (&syncSig, &mutex);
-        l = snprintf(buffer, sizeof(buffer), "s%04x", frame);
-        // ignore errors, nodes will reconnect
-        sendto(fd, buffer, l, 0, (const struct sockaddr*)&addr, SOCKLEN);
+        while (!sendReq && running) pthread_cond_wait (&sendSig, &sendMutex);
+        sendReq = 0;
+        dl = sendDeadline;
+        gsoExtra = 0;
+        if (playing) {
+            pos = sendPlay;
+            pthread_mutex_unlock (&sendMutex);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            n = collectPlay(pos);
+        } else {
+            // renderer did not finish in time, nodes keep the last frame
+            if (!ringFresh) {
+                lateFrames++;
+                continue;
+            }
+            t = ringSend; ringSend = ringReady; ringReady = t;
+            ringFresh = 0;
+            s = ringSend;
+            pthread_cond_signal (&renderSig);
+            pthread_mutex_unlock (&sendMutex);
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            n = mcast ? collectMcast(s) : collectPkts(s);
+        }
+        if (txtime == 2) txtimeCheck();
+        if (diff_us(&beaconTs, &dl) >= BEACON_US) {
+            beaconTs = dl;
+            sendBeacon();
+        }
+        setShowTs(&dl);
+        calls = errs = 0;
+        paceSend(n, &calls, &errs, &dl);
+        // the nodes whose packets did get out see a duplicate, once
+        if (gsoRetry && !playing && !mcast) {
+            gsoExtra = 0;
+            n = collectPkts(s);
+            paceSend(n, &calls, &errs, &dl);
+        }
+        gsoRetry = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        us = diff_us(&t0, &t1);
+        histAdd(&hTx, us);
+        txPkts = n + gsoExtra;
+        txCalls = calls;
+        txErrs += errs;
+        txUsec = us;
+        if (us > txUsecMax) txUsecMax = us;
+        histAdd(&hDone, diff_us(&dl, &t1));
+        txFrames++;
+        txCallSum += calls;
+        txPktSum += n + gsoExtra;
+        pthread_mutex_lock (&sendMutex);
     }
-    close(fd);
+    pthread_mutex_unlock (&sendMutex);
     return NULL;
 }
 
-// look if node is already registered, if not, add a new entry
-void addNode (char *buf, struct in_addr ip) {
-    uint32_t ctrid;
-    uint16_t i, f=0;
-    NODE_T *node;
-    struct sockaddr_in addr;
-    pthread_t thread;
-
-    for (i=0; i<NODE_NR; i++) {
-        if (!f && !nodeip[i]) f = i+1;
-        if (nodeip[i] == ip.s_addr) return; // already registered
-    }
-    if (!f) { printf ("node list full\n"); return; }
-    f--;
-    node = nodes + f;
-    buf++;
-    printf("New node: %s <= %s\n", buf, inet_ntoa(ip));
-    nodeip[f] = ip.s_addr;
-    ctrid = strtol(buf, NULL, 16);
-    node->id = ctrid >> 16;
-    node->len = 3*LED_CNT+2; // 3 byte LED_CNT pixel + header
-    node->mapping = ctrid & 0xffff;
-    node->pkt = malloc(node->len*4);
-    nodecnt++;
-    // create socket
-    if ((node->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("Socket creation");
-        return;
-    }
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr = ip;
-    if (connect(node->fd, (struct sockaddr*) &addr, SOCKLEN) == -1) {
-        perror("Socket connect");
+// AIMD rate control on the feedback of a report: half the rate on loss
+// or late frames, else probe upwards by RATE_STEP per report. The rate
+// applies as divisor of the frame clock, renderLoop staggers the phase
+// by slot.
+void nodeRate (NODESTAT_T *ns) {
+    float max = fps, min = (float)fps / RATE_DIV_MAX;
+    uint8_t div;
+
+    if (!adaptive) return;
+    if (!ns->rate) ns->rate = max;
+    if (ns->loss > LOSS_HI || ns->latePct > LATE_HI) ns->rate /= 2;
+    else if (ns->loss < LOSS_LO && ns->latePct < LATE_LO) ns->rate += RATE_STEP;
+    if (ns->rate > max) ns->rate = max;
+    if (ns->rate < min) ns->rate = min;
+    div = ceilf(max / ns->rate - 0.01f);
+    __atomic_store_n(&ns->rateDiv, div, __ATOMIC_RELAXED);
+}
+
+// receive counters reported by the node after its id:
+// a<id>/<packets>/<frames>/<lost>/<duplicates>/<reordered>/<late>, all
+// hex, cumulative since node start (late is missing from older nodes);
+// rates are computed between two reports
+void nodeReport (int ix, char *buf) {
+    NODESTAT_T *ns = nstat + ix;
+    uint32_t v[6], dp, df, dl;
+    struct timespec now;
+    long us;
+    int i;
+
+    v[5] = 0;
+    for (i=0; i<6; i++) {
+        if (!(buf = strchr(buf, '/'))) {
+            if (i < 5) return;
+            break;
+        }
+        v[i] = strtoul(++buf, NULL, 16);
     }
-    // spin up a new thread for this node
-    if (pthread_create(&thread, NULL, sendLoop, node) != 0) {
-        perror("Failed to create thread");
-        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // counters going back mean the node restarted: take it as new base
+    if (ns->reports && v[0] >= ns->pkts && v[2] >= ns->lost) {
+        dp = v[0] - ns->pkts;
+        df = v[1] - ns->frames;
+        dl = v[2] - ns->lost;
+        us = diff_us(&ns->ts, &now);
+        if (us > 0) ns->fps = df * 1e6 / us;
+        ns->loss = dp + dl ? 100.0 * dl / (dp + dl) : 0;
+        ns->latePct = df && v[5] >= ns->late ? 100.0 * (v[5] - ns->late) / df : 0;
+        nodeRate (ns);
     }
+    ns->pkts = v[0];
+    ns->frames = v[1];
+    ns->lost = v[2];
+    ns->dup = v[3];
+    ns->reorder = v[4];
+    ns->late = v[5];
+    ns->ts = now;
+    ns->reports++;
 }
 
-// process alive packets "a<id>"
+// process alive packets "a<id>", expire silent nodes
 void* receiveLoop(void* arg) {
     struct sockaddr_in addr;
-    uint16_t pktsize;
-    char buffer[64];
-    int fd;
+    struct timeval tv = { 1, 0 };
+    ssize_t pktsize;
+    char buffer[128];
+    int fd, ix, added;
 
     memset(&addr, 0, SOCKLEN);
     addr.sin_family = AF_INET;
@@ -186,14 +886,23 @@ void* receiveLoop(void* arg) {
         close(fd);
         pthread_exit(NULL);
     }
+    // wake up for expiry without alive packets
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        perror("Receive timeout failed");
     while (running) {
         socklen_t len = SOCKLEN;
         pktsize = recvfrom(fd, buffer, sizeof(buffer) - 1, 0,
                             (struct sockaddr*)&addr, &len);
-        if (pktsize > 0) {
+        // other nodes share their config on this port too
+        if (pktsize > 0 && buffer[0] == 'a') {
             buffer[pktsize] = '\0';
-            addNode (buffer, addr.sin_addr);
+            ix = nodeAlive (addr.sin_addr, strtoul(buffer+1, NULL, 16), &added);
+            if (ix < 0) continue;
+            // the divisor in use and the next frame are up to renderLoop
+            if (added) memset(nstat + ix, 0, offsetof(NODESTAT_T, div));
+            nodeReport (ix, buffer);
         }
+        nodeExpire (expireSec * 1000);
     }
     close(fd);
     return NULL;
@@ -203,22 +912,173 @@ void sendControlCmd(int fd, char *b, uint16_t l, int ix) {
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = nodeip[ix];
+    addr.sin_addr.s_addr = nodes[ix].ip;
     sendto(fd, b, l, 0, (const struct sockaddr*)&addr, SOCKLEN);
 }
 
+// nodes of the table pinned for the editor, the first 26 can be selected
 void dispNodelist(void) {
+    uint16_t i, s;
+    uint8_t div;
+    NODE_T *node;
+    NODETAB_T *tab = nodePin(PIN_EDIT);
+
+    for (i=0; i<tab->cnt; i++) {
+        s = tab->slot[i];
+        node = nodes + s;
+        printf ("%c %15s  id %04X  map %04X", i < 26 ? 'A'+i : ' ',
+            inet_ntoa(tab->addr[i].sin_addr), node->id, node->mapping);
+        if (nstat[s].reports > 1)
+            printf ("  %5.1f fps  loss %5.2f%%  late %5.2f%%  lost %u  dup %u  ooo %u",
+                nstat[s].fps, nstat[s].loss, nstat[s].latePct, nstat[s].lost,
+                nstat[s].dup, nstat[s].reorder);
+        if ((div = __atomic_load_n(&nstat[s].rateDiv, __ATOMIC_RELAXED)))
+            printf ("  rate %4.1f/%u", nstat[s].rate, fps / div);
+        printf ("\n");
+    }
+    printf ("%u of %u nodes\n", tab->cnt, nodeMax);
+}
+
+void dispTxStats(void) {
+    printf ("tx %s: %u pkts in %u syscalls, %u us (max %u us), %u errors\n",
+        uringMode(), txPkts, txCalls, txUsec, txUsecMax, txErrs);
+    printf ("tx bytes: %u of %u full\n", txBytes, txRaw);
+    printf ("tx pacing: %u slots over %ld us%s\n", paceSlots, paceUs,
+        txtime == 2 ? ", by the kernel" : "");
+    if (txtime == 2) {
+        printf ("tx departures: %u dropped, %u unmatched\n", txtimeDrops, txtimeMiss);
+        histPrint ("departure", &hDepart);
+    }
+}
+
+void dispClockStats(void) {
+    printf ("clock: %u fps, %u overruns, %u late frames, %u render workers%s\n",
+        fps, overruns, lateFrames, poolSize(), rtCpu != -2 ? ", real-time" : "");
+    histPrint ("lateness", &hLate);
+    histPrint ("period", &hPeriod);
+    histPrint ("render", &hRender);
+    histPrint ("done", &hDone);
+}
+
+void resetStats(void) {
     uint16_t i;
+
+    histReset(&hLate);
+    histReset(&hPeriod);
+    histReset(&hRender);
+    histReset(&hDone);
+    for (i=0; i<=PAT_NR; i++) histReset(hPat + i);
+    histReset(&hEncode);
+    histReset(&hTx);
+    histReset(&hNodeTx);
+    histReset(&hDepart);
+    txtimeDrops = txtimeMiss = 0;
+    overruns = lateFrames = 0;
+    txFrames = 0;
+    txCallSum = txPktSum = 0;
+    txErrs = txUsecMax = 0;
+    for (i=0; nstat && i<nodeMax; i++) nstat[i].txUsMax = nstat[i].txErrs = 0;
+}
+
+// all counters and histograms as plain text, nodes of the table pinned
+// with pin; the frame loop only ever writes them
+void statsWrite(FILE *f, uint16_t pin) {
+    NODETAB_T *tab = nodePin(pin);
+    NODESTAT_T *ns;
     NODE_T *node;
-    struct in_addr ia;
+    uint8_t div;
+    char name[32];
+    uint16_t i;
+
+    fprintf (f, "frames %u fps %u overruns %u late %u nodes %u workers %u\n",
+        txFrames, fps, overruns, lateFrames, tab->cnt, poolSize());
+    fprintf (f, "tx %s pkts %u calls %u errors %u bytes %u raw %u pace_us %ld slots %u txtime %u txtime_drops %u txtime_unmatched %u\n",
+        uringMode(), txPkts, txCalls, txErrs, txBytes, txRaw, paceUs, paceSlots,
+        txtime == 2, txtimeDrops, txtimeMiss);
+    histWrite (f, "lateness", &hLate);
+    histWrite (f, "period", &hPeriod);
+    histWrite (f, "render", &hRender);
+    for (i=0; i<=PAT_NR; i++) {
+        if (!hPat[i].cnt) continue;
+        snprintf (name, sizeof(name), "render/%s", patternName(i));
+        histWrite (f, name, hPat + i);
+    }
+    histWrite (f, "encode", &hEncode);
+    histWrite (f, "send", &hTx);
+    histWrite (f, "node-tx", &hNodeTx);
+    histWrite (f, "done", &hDone);
+    histWrite (f, "departure", &hDepart);
+    for (i=0; i<tab->cnt; i++) {
+        node = nodes + tab->slot[i];
+        ns = nstat + tab->slot[i];
+        div = __atomic_load_n(&ns->rateDiv, __ATOMIC_RELAXED);
+        fprintf (f, "node %s id %04X tx_us %u tx_max_us %u tx_errors %u fps %.1f loss %.2f late %.2f rate %.1f div %u\n",
+            inet_ntoa(tab->addr[i].sin_addr), node->id, ns->txUs, ns->txUsMax,
+            ns->txErrs, ns->fps, ns->loss, ns->latePct, ns->rate, div ? div : 1);
+    }
+}
 
-    for (i=0; i<NODE_NR; i++) {
-        node = nodes+i;
-        if (!node->fd) continue;
-        ia.s_addr = nodeip[i];
-        printf ("%c %15s  id %04X  map %04X\n",
-            'A'+i, inet_ntoa(ia), node->id, node->mapping);
+// plain text endpoint: each connection gets one statistics dump,
+// e.g. socat - UNIX-CONNECT:<path>
+void* statsLoop(void* arg) {
+    struct sockaddr_un addr;
+    int fd, c;
+    FILE *f;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, statsPath, sizeof(addr.sun_path) - 1);
+    unlink(statsPath);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        perror(statsPath);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    while (running) {
+        if ((c = accept(fd, NULL, NULL)) < 0) continue;
+        if (!(f = fdopen(c, "w"))) {
+            close(c);
+            continue;
+        }
+        statsWrite(f, PIN_STATS);
+        nodeUnpin(PIN_STATS);
+        fclose(f);
     }
+    close(fd);
+    return NULL;
+}
+
+static double cpuSec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+         + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// headless run: the configured pattern, let the nodes register, then
+// measure for sec seconds, one line of name value pairs
+void benchRun(uint16_t sec) {
+    struct timespec t0, t1;
+    double c0, s;
+    uint32_t f;
+
+    setPattern(cfgPattern, 0);
+    sleep(BENCH_WARMUP);
+    resetStats();
+    c0 = cpuSec();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sleep(sec);
+    f = txFrames;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    s = diff_us(&t0, &t1) / 1e6;
+    printf ("bench pattern %s nodes %u fps %.1f cpu_us_frame %.0f done_p50 %u done_p99 %u"
+        " syscalls_frame %.2f pkts_frame %.1f late %u overruns %u\n",
+        playing ? "playback" : patternName(cfgPattern), nodecnt, f / s, f ? (cpuSec() - c0) * 1e6 / f : 0,
+        histPercentile(&hDone, 500), histPercentile(&hDone, 990),
+        f ? (double)txCallSum / f : 0, f ? (double)txPktSum / f : 0,
+        lateFrames, overruns);
+    running = 0;
 }
 
 void editLoop(int fd) {
@@ -226,6 +1086,7 @@ void editLoop(int fd) {
     uint16_t level=0, pos, ix, len, es=0;
     char nid[5], map[5];
     NODE_T *node;
+    NODETAB_T *tab;
     char buf[64];
 
     setPattern(cfgPattern, 0);
@@ -241,22 +1102,37 @@ void editLoop(int fd) {
                 case 'L': dispNodelist(); printf("?> "); level=1; break;
                 case 'B': printf ("brightness: %2i", cfgBrightness); level=4; break;
                 case 'P': printf ("pattern: %2i", cfgPattern); level=5; break;
+                case 'T': dispTxStats(); break;
+                case 'J': dispClockStats(); break;
+                case 'S':
+                statsWrite(stdout, PIN_EDIT);
+                nodeUnpin(PIN_EDIT);
+                break;
+                case 'W': // start or stop recording
+                if (playing) break;
+                if (recActive()) printf ("recorded %i frames\n", recStop());
+                else if (recStart(recPath, fps, nodePin(PIN_EDIT)) == 0)
+                    printf ("recording to %s\n", recPath);
+                nodeUnpin(PIN_EDIT);
+                break;
+                case 'R': resetStats(); break;
             }
             break;
             case 1: // select node, start id change
             ix = ch - 'A';
-            if (isalpha(ch) && ix < NODE_NR) {
+            tab = nodePinned(PIN_EDIT);
+            if (isalpha(ch) && ix < tab->cnt) {
+                ix = tab->slot[ix];
                 node = nodes + ix;
-                if (node->fd) {
-                    setPattern(0, ix);
-                    snprintf (nid, sizeof(nid), "%04X", node->id);
-                    printf ("\r%c> id = %04X\x08\x08\x08\x08", ch, node->id);
-                    pos = 0;
-                    level = 2;
-                }
+                setPattern(0, ix);
+                snprintf (nid, sizeof(nid), "%04X", node->id);
+                printf ("\r%c> id = %04X\x08\x08\x08\x08", ch, node->id);
+                pos = 0;
+                level = 2;
             } else {
                 printf ("\r\33[2K");
                 level=0;
+                nodeUnpin(PIN_EDIT);
                 setPattern(cfgPattern, 0);
             }
             break;
@@ -329,50 +1205,202 @@ void editLoop(int fd) {
 }
 
 // read parameters
+// -u: transmit with io_uring, -U: io_uring with kernel submission thread
+// -f <fps>: frame rate, -r <cpu>: real-time mode, pinned when cpu >= 0
+// -w <n>: render workers, default one per CPU
+// -l <file>: node layout on the world canvas
+// -d <n>: delta encoded packets with a keyframe every n frames
+// -p: palette encoded packets when they are shorter
+// -n <n>: max number of nodes, -e <s>: remove nodes silent for s seconds
+// -o <file>: recording written by the W command (default sender.rec)
+// -P <file>: play a recording at its frame rate, repeated, no rendering
+// -b <s>: benchmark, no editor: measure for s seconds and exit
+// -t <n>: pattern n at start (default 2, trains)
+// -S <path>: statistics endpoint on a UNIX socket
+// -m <group>: multicast frames with per node slices to the group (the nodes
+// join MC_GROUP, a warning for others)
+// -L <ms>: nodes show a frame ms after its send deadline (3/4 period)
+// -A: all nodes at the frame rate, no per node rate adaptation
+// -T <ms>: spread the packets of a frame over ms after its send deadline
+// (half the lead), 0 sends them in one burst
+// -K: the kernel paces the packets (SO_TXTIME, fq or ETF qdisc, the CLOCK_TAI
+// of ETF is detected), user space pacing when it is not available
+// -G: a message per packet, no UDP GSO for the packets of a node
 int main(int argc, char* argv[]) {
-    pthread_t listener, pixeldraw, syncer;
-    int fd;
+    pthread_t listener, renderer, ticker, sender, scraper;
+    int fd, opt, on = 1, off = 0, max = NODE_NR;
+    uint16_t i, pnodes;
+    char *playPath = NULL;
+    uint16_t benchSec = 0;
     struct termios ts;
 
-    nodes = malloc(sizeof(NODE_T) * NODE_NR);
-    memset (nodes, 0, sizeof(NODE_T) * NODE_NR);
-    memset (nodeip, 0, sizeof(nodeip));
+    workerCnt = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "uUf:r:w:l:d:pn:e:o:P:b:t:S:m:L:AT:KG")) != -1) {
+        switch (opt) {
+            case 'u': txring = 1; break;
+            case 'U': txring = 2; break;
+            case 'f': fps = atoi(optarg); break;
+            case 'r': rtCpu = atoi(optarg) < 0 ? -1 : atoi(optarg); break;
+            case 'w': workerCnt = atoi(optarg); break;
+            case 'l': if (loadLayout(optarg) < 0) exit(EXIT_FAILURE); break;
+            case 'd': setDelta(atoi(optarg)); break;
+            case 'p': setPalette(1); break;
+            case 'n': max = atoi(optarg); break;
+            case 'e': expireSec = atoi(optarg); break;
+            case 'o': recPath = optarg; break;
+            case 'P': playPath = optarg; break;
+            case 'b': benchSec = atoi(optarg); break;
+            case 't':
+            cfgPattern = atoi(optarg);
+            if (cfgPattern < 1 || cfgPattern > PAT_NR) {
+                fprintf(stderr, "%s: patterns are 1 to %u\n", optarg, PAT_NR);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            case 'S': statsPath = optarg; break;
+            case 'm':
+            if (!inet_aton(optarg, &mcaddr.sin_addr) || !IN_MULTICAST(ntohl(mcaddr.sin_addr.s_addr))) {
+                fprintf(stderr, "%s: not a multicast group\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (mcaddr.sin_addr.s_addr != inet_addr(MC_GROUP))
+                fprintf(stderr, "%s: the nodes join %s only\n", optarg, MC_GROUP);
+            mcast = 1;
+            break;
+            case 'L': showLead = atol(optarg) * 1000; break;
+            case 'A': adaptive = 0; break;
+            case 'T': paceUs = atol(optarg) * 1000; break;
+            case 'K': txtime = 1; break;
+            case 'G': gso = 0; break;
+            default:
+            fprintf(stderr, "usage: %s [-u|-U] [-f fps] [-r cpu] [-w workers] [-l layout] [-d keyint] [-p] [-n nodes] [-e expire] [-o file] [-P file] [-b seconds] [-t pattern] [-S socket] [-m group] [-L lead] [-A] [-T pace] [-K] [-G]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (max < 1 || max > NODE_LIMIT) max = NODE_NR;
+    // the message vector must hold the recorded nodes
+    if (playPath) {
+        if (playOpen(playPath, PORT, &fps, &pnodes) < 0) exit(EXIT_FAILURE);
+        if (pnodes > NODE_LIMIT) {
+            fprintf(stderr, "%s: %u nodes, at most %u\n", playPath, pnodes, NODE_LIMIT);
+            playClose();
+            exit(EXIT_FAILURE);
+        }
+        if (pnodes > max) max = pnodes;
+        playing = 1;
+    }
+    if (fps < 1 || fps > 1000) fps = 30;
+    // the next frame must not arrive before the last one was shown
+    if (showLead <= 0 || showLead >= 1000000L / fps) showLead = 750000L / fps;
+    // the last packets must arrive before the show
+    if (paceUs < 0 || paceUs >= showLead) paceUs = showLead / 2;
+    // real-time mode: no page faults in the frame loop
+    if (rtCpu != -2 && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) perror("mlockall");
+    resetStats();
+    // node slots keep their packet buffers for the whole run
+    if (initRegistry(max, PORT) < 0) exit(EXIT_FAILURE);
+    pktbuf = malloc((size_t)nodeMax * FRAME_RING * NODE_BUF + FRAME_RING * SHARE_BUF);
+    nstat = calloc(nodeMax, sizeof(NODESTAT_T));
+    dueSlot = malloc(nodeMax * sizeof(uint16_t));
+    txmsg = calloc(TX_MAX, sizeof(struct mmsghdr));
+    txiov = calloc(3 * TX_MAX, sizeof(struct iovec));
+    txctl = calloc(TX_MAX, TXCTL_LEN);
+    txSlot = calloc(TX_MAX, sizeof(uint16_t));
+    txRes = calloc(TX_MAX, sizeof(int32_t));
+    // a datagram per packet at most, with one slice each
+    mchdr = malloc(TX_MAX * (MC_HDR + MC_SLICE));
+    mciov = calloc(4 * TX_MAX, sizeof(struct iovec));
+    if (!pktbuf || !nstat || !dueSlot || !txmsg || !txiov || !txctl || !txSlot || !txRes || !mchdr || !mciov) {
+        perror("Buffer allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (i=0; i<nodeMax; i++) nodes[i].ring = pktbuf + (size_t)i * FRAME_RING * NODE_BUF;
+    sharebuf = pktbuf + (size_t)nodeMax * FRAME_RING * NODE_BUF;
+    // fall back to sendmmsg when io_uring is not available
+    if (txring && uringInit(TX_MAX, txring == 2) < 0) {
+        printf("io_uring not available, using sendmmsg\n");
+        txring = 0;
+    }
     // control command socket
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    // pixel data and time beacon socket, shared by all nodes
+    if ((txfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt (txfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0) {
+        perror("Broadcast flag failed");
+    }
+    // UDP GSO since Linux 4.18, the segment size is set per message
+    if (gso && setsockopt(txfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) < 0) {
+        printf("UDP GSO not available, a message per packet\n");
+        gso = 0;
+    }
+    if (txtime && txtimeInit() < 0) {
+        printf("SO_TXTIME not available, pacing in user space\n");
+        txtime = 0;
+    }
+    bcaddr.sin_family = AF_INET;
+    bcaddr.sin_port = htons(PORT);
+    bcaddr.sin_addr.s_addr = INADDR_BROADCAST;
+    mcaddr.sin_family = AF_INET;
+    mcaddr.sin_port = htons(PORT);
 
     pthread_cond_init (&sendSig, NULL);
-    pthread_cond_init (&syncSig, NULL);
+    pthread_cond_init (&renderSig, NULL);
     pthread_cond_init (&pixelSig, NULL);
     if (pthread_create(&listener, NULL, receiveLoop, NULL) != 0) {
         perror("Failed to create receiveLoop");
         exit(EXIT_FAILURE);
     }
-    if (pthread_create(&pixeldraw, NULL, pixelLoop, NULL) != 0) {
-        perror("Failed to create pixelLoop");
+    if (!playing && pthread_create(&renderer, NULL, renderLoop, NULL) != 0) {
+        perror("Failed to create renderLoop");
         exit(EXIT_FAILURE);
     }
-    if (pthread_create(&syncer, NULL, syncLoop, NULL) != 0) {
-        perror("Failed to create syncLoop");
+    if (pthread_create(&ticker, NULL, clockLoop, NULL) != 0) {
+        perror("Failed to create clockLoop");
         exit(EXIT_FAILURE);
     }
-    // non-canoncal, no echo => no line edit
-    tcgetattr(STDIN_FILENO, &ts);
-    ts.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &ts);
-    
-    editLoop(fd);
-
-    pthread_cond_destroy (&sendSig);
-    pthread_cond_destroy (&syncSig);
-    pthread_cond_destroy (&pixelSig);
+    if (pthread_create(&sender, NULL, sendLoop, NULL) != 0) {
+        perror("Failed to create sendLoop");
+        exit(EXIT_FAILURE);
+    }
+    // not joined, it waits in accept
+    if (statsPath) {
+        signal(SIGPIPE, SIG_IGN);
+        if (pthread_create(&scraper, NULL, statsLoop, NULL) == 0) pthread_detach(scraper);
+        else perror("Failed to create statsLoop");
+    }
+    if (benchSec) benchRun(benchSec);
+    else {
+        // non-canoncal, no echo => no line edit
+        tcgetattr(STDIN_FILENO, &ts);
+        ts.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &ts);
+        editLoop(fd);
+        // canonical mode, echo
+        ts.c_lflag |= (ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &ts);
+    }
     printf("\nStopping threads...");
-    pthread_join(pixeldraw, NULL);
+    pthread_join(ticker, NULL);
+    pthread_mutex_lock (&sendMutex);
+    pthread_cond_signal (&sendSig);
+    pthread_cond_signal (&renderSig);
+    pthread_mutex_unlock (&sendMutex);
+    pthread_join(sender, NULL);
+    if (!playing) pthread_join(renderer, NULL);
     printf(" done.\n");
-    // canonical mode, echo
-    ts.c_lflag |= (ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &ts);
+    if (recActive()) printf ("recorded %i frames\n", recStop());
+    if (playing) playClose();
+    if (statsPath) unlink(statsPath);
+    pthread_cond_destroy (&sendSig);
+    pthread_cond_destroy (&renderSig);
+    pthread_cond_destroy (&pixelSig);
+    if (txring) uringExit();
+    close(txfd);
     return 0;
 }
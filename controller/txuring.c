@@ -0,0 +1,180 @@
+// io_uring transmit backend, using the raw syscall interface
+// all packets of a frame are submitted as one batch of SQEs; every
+// message is a gather list (header, pixel data, presentation time), so
+// sends go by sendmsg, zero copy where the kernel supports it
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "txuring.h"
+
+static int ringfd = -1;
+static uint32_t *sqhead, *sqtail, *sqmask, *sqflags, *sqarray;
+static uint32_t *cqhead, *cqtail, *cqmask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sqring, *cqring;
+static size_t sqsize, cqsize, sqesize;
+// zero copy send support for gather lists, sq polling thread
+static int zcmsg, sqpolled;
+// longest gather list for zero copy, below MAX_SKB_FRAGS
+#define ZC_IOV_MAX 16
+
+static int enter(unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ringfd, submit, wait, flags, NULL, 0);
+}
+
+// check if the kernel knows about a send op
+static int probeOp(uint8_t op) {
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *pr = calloc(1, sz);
+    int r = 0;
+
+    if (!pr) return 0;
+    if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PROBE, pr, 256) == 0 &&
+        pr->last_op >= op && (pr->ops[op].flags & IO_URING_OP_SUPPORTED)) r = 1;
+    free(pr);
+    return r;
+}
+
+// set up the ring, -1 on failure
+int uringInit(unsigned entries, int sqpoll) {
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000; // ms until the kernel thread sleeps
+    }
+    ringfd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ringfd < 0) {
+        perror("io_uring setup");
+        return -1;
+    }
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqsize > sqsize) sqsize = cqsize;
+        cqsize = sqsize;
+    }
+    sqring = mmap(NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  ringfd, IORING_OFF_SQ_RING);
+    if (sqring == MAP_FAILED) goto fail;
+    cqring = sqring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cqring = mmap(NULL, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                      ringfd, IORING_OFF_CQ_RING);
+        if (cqring == MAP_FAILED) goto fail;
+    }
+    sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) goto fail;
+    sq = sqring;
+    cq = cqring;
+    sqhead = (uint32_t*)(sq + p.sq_off.head);
+    sqtail = (uint32_t*)(sq + p.sq_off.tail);
+    sqmask = (uint32_t*)(sq + p.sq_off.ring_mask);
+    sqflags = (uint32_t*)(sq + p.sq_off.flags);
+    sqarray = (uint32_t*)(sq + p.sq_off.array);
+    cqhead = (uint32_t*)(cq + p.cq_off.head);
+    cqtail = (uint32_t*)(cq + p.cq_off.tail);
+    cqmask = (uint32_t*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    sqpolled = sqpoll;
+    zcmsg = probeOp(IORING_OP_SENDMSG_ZC);
+    return 0;
+fail:
+    perror("io_uring mmap");
+    uringExit();
+    return -1;
+}
+
+const char *uringMode(void) {
+    if (ringfd < 0) return "sendmmsg";
+    if (zcmsg) return sqpolled ? "io_uring zc sqpoll" : "io_uring zc";
+    return sqpolled ? "io_uring sendmsg sqpoll" : "io_uring sendmsg";
+}
+
+static void prepSqe(struct io_uring_sqe *sqe, int fd, struct msghdr *mh, uint64_t tag) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    // zero copy on kernels since 6.1 when each entry fits in a fragment
+    // of the skb (EMSGSIZE otherwise), longer lists are copied
+    sqe->opcode = zcmsg && mh->msg_iovlen <= ZC_IOV_MAX
+                ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)mh;
+    sqe->len = 1;
+}
+
+// submit all messages as one linked batch, in order. Returns when every request and its
+// zero copy notification completed, so the buffers can be reused.
+// res (optional) receives the result of each message.
+uint16_t uringSend(int fd, struct mmsghdr *msg, uint16_t n,
+                    uint32_t *calls, uint32_t *errs, int32_t *res) {
+    uint32_t tail, head, i, pending = 0, done = 0;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+
+    tail = *sqtail;
+    for (i=0; i<n; i++) {
+        sqe = sqes + (tail & *sqmask);
+        prepSqe(sqe, fd, &msg[i].msg_hdr, i);
+        if (res) res[i] = 0;
+        // hard links keep the order, a failing send does not cancel the rest
+        if (i < n-1u) sqe->flags = IOSQE_IO_HARDLINK;
+        sqarray[tail & *sqmask] = tail & *sqmask;
+        tail++;
+    }
+    __atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+    pending = n;
+    if (sqpolled) {
+        if (__atomic_load_n(sqflags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+            enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+            (*calls)++;
+        }
+    } else {
+        enter(n, 0, 0);
+        (*calls)++;
+    }
+    while (pending) {
+        head = *cqhead;
+        if (head == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) {
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0) break;
+            (*calls)++;
+            continue;
+        }
+        cqe = cqes + (head & *cqmask);
+        if (cqe->flags & IORING_CQE_F_NOTIF) pending--;
+        else {
+            if (cqe->res < 0) (*errs)++;
+            if (res && cqe->user_data < n) res[cqe->user_data] = cqe->res;
+            done++;
+            // zero copy: another notification cqe will follow
+            if (!(cqe->flags & IORING_CQE_F_MORE)) pending--;
+        }
+        __atomic_store_n(cqhead, head+1, __ATOMIC_RELEASE);
+    }
+    return done;
+}
+
+void uringExit(void) {
+    if (sqes && sqes != MAP_FAILED) munmap(sqes, sqesize);
+    if (cqring && cqring != MAP_FAILED && cqring != sqring) munmap(cqring, cqsize);
+    if (sqring && sqring != MAP_FAILED) munmap(sqring, sqsize);
+    sqes = NULL;
+    sqring = cqring = NULL;
+    if (ringfd >= 0) close(ringfd);
+    ringfd = -1;
+}
+
+// eof
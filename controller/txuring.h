@@ -0,0 +1,9 @@
+// txuring.c provides:
+
+int uringInit(unsigned entries, int sqpoll);
+uint16_t uringSend(int fd, struct mmsghdr *msg, uint16_t n,
+                    uint32_t *calls, uint32_t *errs, int32_t *res);
+const char *uringMode(void);
+void uringExit(void);
+
+// eof
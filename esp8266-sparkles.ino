@@ -211,7 +211,7 @@ uint16_t reqts; // ts of switch press
 uint16_t wifi_param; // bitmap which parameters have been set from UDP/TCP packets
 void re_read(void);
 // cyclic parameters
-uint16_t sparks_hue, colors_ts, colors_gts, colors_off;
+uint16_t colors_ts, colors_gts, colors_off;
 
 // ######################################################################
 
@@ -220,13 +220,56 @@ IPAddress gateway(192,168,100,1);
 IPAddress subnet(255,255,255,0);
 IPAddress bcast(192,168,100,255);
 IPAddress act_bcast;
+// group of the multicast frames, see handleSlices, MC_GROUP of the controller
+IPAddress mcast_group(239,255,57,0);
+uint8_t mcast_joined, wifi_up;
+uint16_t mcast_tim;
 
 ESP8266WebServer server(80);
 WrapUDP udp_endpoint;
 #define UDP_PORT 5700
 #define ALIVE_PKT_LEN 128
 
-uint16_t ts_rec, ts_prev=0, ts_diff=0, ts_hist=0, tsa[8], tscnt=0;
+// synchronized clock: 64 bit microseconds of the reference, the sender,
+// the lead node for its followers, or our own clock while no time beacon
+// "t<8 hex digits>" (low 32 bit of the reference clock) arrives. Offset
+// samples are binned over CLK_BIN, the largest offset of a bin is the
+// least delayed packet. The drift is fitted over the last CLK_PTS bins,
+// the offset taken from their upper envelope; corrections are slewed in
+// over CLK_SLEW, only errors beyond CLK_STEP are stepped.
+#define CLK_PTS 8
+#define CLK_BIN 1000000
+#define CLK_SLEW 2000000
+#define CLK_STEP 50000
+#define CLK_DRIFT_MAX 0.0005
+uint64_t clk_loc[CLK_PTS], clk_bloc, clk_bstart, clk_rx;
+int64_t clk_off[CLK_PTS], clk_boff;
+uint8_t clk_pn=0, clk_pi=0, clk_bcnt=0, clk_bad=0, clk_synced=0;
+// applied clock: reference time at the local anchor, drift, and the error
+// that is slewed in after the anchor
+uint64_t clk_aloc=0, clk_aref=0;
+int32_t clk_slew=0;
+float clk_drift=0;
+
+// binary packet encodings, see handleBinary
+#define PKT_SHOW 0x10
+#define PTS_LEN 4
+#define PKT_DELTA 0x20
+#define PKT_PALETTE 0x40
+// frame waiting for its presentation time, see scheduleShow
+uint8_t show_pend=0, show_frame;
+uint32_t show_at;
+// presentation times further ahead are taken as clock error
+#define SHOW_AHEAD_MAX 1000000
+// frame number held per logical channel, bit field of valid channels
+uint8_t chFrame[4], chValid=0;
+// receive statistics, reported to the server with the alive packet:
+// packets, frames, frames lost, duplicates, reordered (late) packets,
+// frames past their presentation time on arrival
+uint32_t rxPkts=0, rxFrames=0, rxLost=0, rxDup=0, rxReorder=0, rxLate=0;
+uint8_t seqLast[4], seqValid=0, rxFrame;
+uint16_t stat_tim;
+#define SEQ_RESYNC 32  // larger gaps are a restarted stream, not loss
 
 void handleUDP(pbuf *pb);
 
@@ -276,9 +319,20 @@ enum WiFiModes {
   WIFI_LEAD
 };
 #define WIFI_MAX_PARM WIFI_LEAD
+
+// join the multicast group once the interface is up, a membership of a
+// previous connection is dropped first so the join is reported again
+void mcast_join() {
+  mcast_tim = now;
+  if (wifimode == WIFI_NONE || wifimode == WIFI_FOLLOW) return;
+  if (mcast_joined) udp_endpoint.leaveGroup(mcast_group);
+  mcast_joined = udp_endpoint.joinGroup(mcast_group);
+}
+
 void wifi_config(uint8_t wm) {
   WiFi.disconnect(true);  // first reset
   server.stop();
+  if (mcast_joined) udp_endpoint.leaveGroup(mcast_group);  // the membership outlives the pcb
   udp_endpoint.close();
   switch (wm) {
     case WIFI_NONE: break;
@@ -300,6 +354,10 @@ void wifi_config(uint8_t wm) {
     udp_endpoint.listen(wm==WIFI_FOLLOW ? UDP_PORT+1 : UDP_PORT);  // bind to port
   }
   udp_endpoint.onPacket(handleUDP);
+  mcast_joined = 0;
+  // the access point is up now, a station joins once connected, see loop
+  wifi_up = wm == WIFI_LEAD;
+  if (wifi_up) mcast_join();
   wifi_param = 0; // wifi_param bitmap holds which parameters have been set via WiFi
 }
 
@@ -334,14 +392,16 @@ void handleCommand(uint8_t *rt, uint16_t len) {
         hexval <<= 4; hexval += cval; idc++;
         if (idc >= 8) { conf.ctrid=hexval; idc=0; cmd=0; }
         break;
-        // receive a new 4 HEX digit delta timestamp
+        // 4 HEX digit timestamp of the lead node: its state follows,
+        // the clock itself comes with the time beacons
         case 't': wifi_param|=0x040;
-        hexval <<= 4; hexval += cval; idc++;
-        if (idc >= 4) { ts_rec=hexval; hexval=0; idc=0; cmd=0; }
+        idc++;
+        if (idc >= 4) { idc=0; cmd=0; }
         break;
+        // hue of older lead nodes, now derived from the clock
         case 'h':
-        hexval <<= 4; hexval += cval; idc++;
-        if (idc >= 4) { sparks_hue=hexval; hexval=0; idc=0; cmd=0; }
+        idc++;
+        if (idc >= 4) { idc=0; cmd=0; }
         break;
         case 'e':
         hexval <<= 4; hexval += cval; idc++;
@@ -359,14 +419,104 @@ void handleCommand(uint8_t *rt, uint16_t len) {
       }
     }
   }
-  if (wifi_param & 0x040) { // timestamp received => calculate most probable time
-    ts_diff = ts_rec - now + 10;
-    tsa[tscnt++] = (ts_rec - ts_prev) - (now - ts_hist);
-    ts_prev = ts_rec;
-    if (tscnt >= 8) {
-      tscnt = 0;
-    }
+}
+
+// reference time at local time loc
+uint64_t syncAt(uint64_t loc) {
+  int64_t dt = loc - clk_aloc;
+  int64_t sl = dt >= CLK_SLEW ? clk_slew : (int64_t)clk_slew * dt / CLK_SLEW;
+  return clk_aref + dt + (int64_t)(dt * clk_drift) + sl;
+}
+
+uint64_t syncUs() {
+  return syncAt(micros64());
+}
+
+uint32_t syncMs() {
+  return syncUs() / 1000;
+}
+
+// fit drift and offset to the points, move the applied clock to them
+void clockFit(uint64_t loc) {
+  float sx=0, sy=0, sxx=0, sxy=0, x, y, dn, drift=0;
+  int64_t e, est=0, o0 = clk_off[(clk_pi+CLK_PTS-1) % CLK_PTS];
+  uint64_t cur;
+  uint8_t i;
+  // least squares: seconds before loc => microseconds offset
+  for (i=0; i<clk_pn; i++) {
+    x = (int64_t)(clk_loc[i] - loc) * 1e-6;
+    y = clk_off[i] - o0;
+    sx += x; sy += y; sxx += x*x; sxy += x*y;
+  }
+  dn = clk_pn*sxx - sx*sx;
+  if (clk_pn >= 3 && dn > 0) drift = (clk_pn*sxy - sx*sy) / dn * 1e-6;
+  if (drift > CLK_DRIFT_MAX) drift = CLK_DRIFT_MAX;
+  if (drift < -CLK_DRIFT_MAX) drift = -CLK_DRIFT_MAX;
+  // upper envelope of the points, carried forward with the drift
+  for (i=0; i<clk_pn; i++) {
+    e = clk_off[i] + (int64_t)((int64_t)(loc - clk_loc[i]) * drift);
+    if (!i || e > est) est = e;
   }
+  cur = syncAt(loc);
+  e = (int64_t)(loc + est - cur);
+  clk_aloc = loc;
+  clk_drift = drift;
+  if (!clk_synced || e > CLK_STEP || e < -CLK_STEP) {
+    clk_aref = loc + est;
+    clk_slew = 0;
+    clk_synced = 1;
+  } else {
+    clk_aref = cur;
+    clk_slew = e;
+  }
+}
+
+// reference time ref of a beacon received at local time loc
+void clockSample(uint32_t ref, uint64_t loc) {
+  uint64_t pred = syncAt(loc);
+  int64_t off = (int64_t)(pred + (int32_t)(ref - (uint32_t)pred) - loc);
+  int64_t err = off - (int64_t)(pred - loc);
+  // a late packet is an outlier, a few in a row a restarted reference
+  if (err > CLK_STEP || err < -CLK_STEP) {
+    if (clk_synced && ++clk_bad < 3) return;
+    clk_pn = 0; clk_bcnt = 0; clk_synced = 0;
+  }
+  clk_bad = 0;
+  if (!clk_bcnt || off > clk_boff) { clk_boff = off; clk_bloc = loc; }
+  if (!clk_bcnt++) clk_bstart = loc;
+  if (clk_synced && loc - clk_bstart < CLK_BIN) return;
+  // the bin is complete: its least delayed sample is the next point
+  clk_loc[clk_pi] = clk_bloc;
+  clk_off[clk_pi] = clk_boff;
+  clk_pi = (clk_pi + 1) % CLK_PTS;
+  if (clk_pn < CLK_PTS) clk_pn++;
+  clk_bcnt = 0;
+  clockFit(loc);
+}
+
+// time beacon: 't', reference microseconds as 8 HEX digits
+void handleClock(uint8_t *rt, uint16_t len) {
+  uint32_t ref = 0;
+  uint8_t i, c;
+  if (len < 8) return;
+  for (i=0; i<8; i++) {
+    c = rt[i];
+    if (c >= 'a') c -= 'a'-10;
+    else if (c >= 'A') c -= 'A'-10;
+    else c -= '0';
+    ref = (ref << 4) | (c & 0x0f);
+  }
+  clockSample(ref, clk_rx);
+}
+
+// time beacon of the lead node for its followers
+void sendClock() {
+  pbuf* clockPkt = pbuf_alloc(PBUF_TRANSPORT, 16, PBUF_RAM);
+  uint16_t wlen = snprintf((char*)clockPkt->payload, 16, "t%08x", (uint32_t)syncUs());
+  clockPkt->len = wlen;
+  clockPkt->tot_len = wlen;
+  udp_endpoint.writeTo(clockPkt, act_bcast, UDP_PORT+1);
+  pbuf_free(clockPkt);
 }
 
 // 0..9, a..z
@@ -380,12 +530,8 @@ void share_config() {
   pbuf* alivePkt = pbuf_alloc(PBUF_TRANSPORT, ALIVE_PKT_LEN, PBUF_RAM);
   uint8_t * pktptr = (uint8_t*)(alivePkt->payload);
   uint16_t wlen = snprintf((char*)pktptr, ALIVE_PKT_LEN, "cp%xb%xc%cs%cd%ct%04x",
-      type, bri, as_exthex(col), as_exthex(del), as_exthex(dens), now);
+      type, bri, as_exthex(col), as_exthex(del), as_exthex(dens), (uint16_t)syncMs());
   switch (type) {
-    case 0: // sparks
-    wlen += snprintf((char*)pktptr+wlen, ALIVE_PKT_LEN-wlen,
-              "h%04x", sparks.hue);
-    break;
     case 2: // duco
     wlen += snprintf((char*)pktptr+wlen, ALIVE_PKT_LEN-wlen,
               "e%04xg%04xo%x", colors.ts, colors.gts, colors.off);
@@ -395,6 +541,7 @@ void share_config() {
   alivePkt->tot_len = wlen;
   udp_endpoint.writeTo(alivePkt, act_bcast, UDP_PORT+1);
   pbuf_free(alivePkt);
+  sendClock();
 }
 
 // web browser sending back an AJAX post message with commands
@@ -408,7 +555,8 @@ void handlePost() {
   }
 }
 
-// got a special UDP packet with a sync command
+// got a special UDP packet with a sync command of an older sender,
+// newer ones send the presentation time with the frame
 // => write LED data
 void handleSync(uint8_t *rt, uint16_t len) {
   if (type != 255) return;
@@ -416,34 +564,204 @@ void handleSync(uint8_t *rt, uint16_t len) {
   strip.show();
 }
 
-// got a UDP packet with LED string data:
-// first byte defines show flag (s) and strip bit field: 000s4321
-// 0x1F = write pattern to all strips and show it
-// default map 0x8421 
-void handleBinary(uint8_t *rt, uint16_t len) {
-  uint16_t map = conf.ctrid & 0x0000ffff;
-  uint8_t cmd = *rt++;
-  uint8_t frame = *rt++;
-  uint8_t *pix = strip.getPixels();
-  len--;
+// switch to UDP pixel mode on the first data packet
+void udpPixelMode() {
   if (type != 255) { // first UDP packet => reconfigure strip
     type = 255;
     strip.clear();
     strip.setBrightness(255); // server does all brightness scaling
     split = 2; // set strip config to NEO_SPLIT4
     strip_config();
+    chValid = 0;
+    show_pend = 0;
   }
-  if (len > led_cnt) len = led_cnt;
-  // the map defines for which pin the data shall go
-  // it is a set of 4 hex nibbles
+}
+
+// copy n bytes to offset off of all pins the channels in cmd are mapped to
+// the map defines for which pin the data shall go
+// it is a set of 4 hex nibbles
+void writeChannels(uint8_t cmd, uint16_t off, uint8_t *data, uint16_t n) {
+  uint16_t map = conf.ctrid & 0x0000ffff;
+  uint8_t *pix = strip.getPixels();
+  if (off >= led_cnt) return;
+  if (n > led_cnt - off) n = led_cnt - off;
   while (map) {
-    if (map & cmd & 0x0f) memcpy (pix, rt, len);
+    if (map & cmd & 0x0f) memcpy (pix + off, data, n);
     pix += led_cnt;
     map >>= 4;
   }
-  if (cmd & 0x10) {   // bit 's' is set => show 
-    alive_tim = now;  // update alive flag, data has been received
-    strip.show();
+}
+
+// show the pending frame
+void presentFrame() {
+  show_pend = 0;
+  strip.show();
+}
+
+// the frame is shown from loop() at presentation time pts, right away
+// while our clock is not synchronized or pts is far off
+void scheduleShow(uint8_t frame, uint32_t pts) {
+  int32_t d = pts - (uint32_t)syncUs();
+  alive_tim = now;  // update alive flag, data has been received
+  // the server lowers our frame rate when frames come in late
+  if (clk_synced && d < 0 && !(show_pend && show_frame == frame)) rxLate++;
+  if (!clk_synced || d > SHOW_AHEAD_MAX || d < -SHOW_AHEAD_MAX) pts -= d;
+  show_frame = frame;
+  show_at = pts;
+  show_pend = 1;
+}
+
+void showDue() {
+  if (show_pend && (int32_t)((uint32_t)syncUs() - show_at) >= 0) presentFrame();
+}
+
+// got a UDP packet with changes to the previous frame: 001s4321,
+// frame, base frame, then spans of offset (2 byte, little endian),
+// count and count bytes. Only applied when all addressed channels
+// hold the base frame, otherwise we wait for the next full packet.
+void handleDelta(uint8_t *rt, uint16_t len) {
+  uint8_t cmd = *rt++;
+  uint8_t frame = *rt++;
+  uint8_t base = *rt++;
+  uint8_t c, n;
+  uint16_t off;
+  len -= 3;
+  for (c=0; c<4; c++) {
+    if (!(cmd & (1<<c))) continue;
+    if (!(chValid & (1<<c)) || chFrame[c] != base) {
+      chValid &= ~cmd;
+      return;
+    }
+  }
+  while (len >= 3) {
+    off = rt[0] | (rt[1] << 8);
+    n = rt[2];
+    rt += 3;
+    len -= 3;
+    if (n > len) break;
+    writeChannels(cmd, off, rt, n);
+    rt += n;
+    len -= n;
+  }
+  for (c=0; c<4; c++) if (cmd & (1<<c)) chFrame[c] = frame;
+}
+
+// got a UDP packet with a color palette: 010s4321, frame, palette size-1,
+// palette entries of 3 bytes in strip byte order, then one palette index
+// per pixel; the pixels are expanded while copying to the mapped pins
+void handlePalette(uint8_t *rt, uint16_t len) {
+  uint16_t map = conf.ctrid & 0x0000ffff;
+  uint8_t cmd = rt[0];
+  uint8_t frame = rt[1];
+  uint16_t pcnt = rt[2] + 1, n, i;
+  uint8_t *pal = rt + 3, *idx = pal + 3*pcnt, *pix = strip.getPixels(), *d, *s;
+  uint8_t c;
+  if (len < 3 + 3*pcnt) return;
+  n = len - 3 - 3*pcnt;
+  if (n > led_cnt / 3) n = led_cnt / 3;
+  while (map) {
+    if (map & cmd & 0x0f) {
+      d = pix;
+      for (i=0; i<n; i++) {
+        s = idx[i] < pcnt ? pal + 3*idx[i] : pal;
+        *d++ = s[0];
+        *d++ = s[1];
+        *d++ = s[2];
+      }
+    }
+    pix += led_cnt;
+    map >>= 4;
+  }
+  // like a full packet, the channels now hold this frame
+  for (c=0; c<4; c++) if (cmd & (1<<c)) chFrame[c] = frame;
+  chValid |= cmd & 0x0f;
+}
+
+// count lost, duplicate and reordered frames per channel,
+// the 8 bit frame number is compared modulo 256; a gap counts once per
+// packet, the frames missing on its channels, like rxPkts
+void trackSeq(uint8_t cmd, uint8_t frame) {
+  uint8_t c, d, gap = 0;
+  rxPkts++;
+  if (!seqValid) rxFrame = frame - 1;
+  d = frame - rxFrame;
+  if (d && d < 128) { rxFrames++; rxFrame = frame; }
+  for (c=0; c<4; c++) {
+    if (!(cmd & (1<<c))) continue;
+    d = frame - seqLast[c];
+    if (seqValid & (1<<c)) {
+      if (d == 0) rxDup++;
+      else if (d >= 128) { rxReorder++; continue; }
+      else if (d <= SEQ_RESYNC && d - 1 > gap) gap = d - 1;
+    }
+    seqLast[c] = frame;
+    seqValid |= 1<<c;
+  }
+  rxLost += gap;
+}
+
+// broadcast the controller ID and receive statistics to port +1,
+// the server collects controller IDs and corresponding IP addresses
+void sendAlive() {
+  pbuf* alivePkt = pbuf_alloc(PBUF_TRANSPORT, ALIVE_PKT_LEN, PBUF_RAM);
+  uint8_t * pktptr = (uint8_t*)(alivePkt->payload);
+  uint16_t wlen = snprintf((char*)pktptr, ALIVE_PKT_LEN, "a%08x/%x/%x/%x/%x/%x/%x",
+    conf.ctrid, rxPkts, rxFrames, rxLost, rxDup, rxReorder, rxLate);
+  alivePkt->len = wlen;
+  alivePkt->tot_len = wlen;
+  udp_endpoint.writeTo(alivePkt, act_bcast, UDP_PORT+1);
+  pbuf_free(alivePkt);
+}
+
+// got a UDP packet with LED string data:
+// first byte defines show flag (s) and strip bit field: 000s4321
+// 0x1F = write pattern to all strips and show it
+// default map 0x8421 
+// with the show flag the packet ends in the presentation time of the
+// frame, 4 bytes little endian, synchronized clock in microseconds
+void handleBinary(uint8_t *rt, uint16_t len) {
+  uint8_t cmd = rt[0];
+  uint8_t frame = rt[1];
+  uint32_t pts = 0;
+  uint8_t c;
+  if (len < 3) return;
+  if (cmd & PKT_SHOW) {
+    if (len < 3 + PTS_LEN) return;
+    len -= PTS_LEN;
+    pts = rt[len] | (rt[len+1] << 8) | ((uint32_t)rt[len+2] << 16) | ((uint32_t)rt[len+3] << 24);
+  }
+  trackSeq(cmd, frame);
+  udpPixelMode();
+  // a newer frame overwrites the pixels: show the pending one now
+  if (show_pend && frame != show_frame) presentFrame();
+  if (cmd & PKT_DELTA) handleDelta(rt, len);
+  else if (cmd & PKT_PALETTE) handlePalette(rt, len);
+  else {
+    writeChannels(cmd, 0, rt+2, len-2);
+    // full packet: the channels now hold this frame
+    for (c=0; c<4; c++) if (cmd & (1<<c)) chFrame[c] = frame;
+    chValid |= cmd & 0x0f;
+  }
+  if (cmd & PKT_SHOW) scheduleShow(frame, pts);
+}
+
+// got a multicast frame with the channel packets of many nodes:
+// 'm', frame, slice count, then per slice the node id (upper half of
+// ctrid), offset and length of a channel packet in this datagram, all
+// 2 byte little endian; the packets of our id are handled as usual
+void handleSlices(uint8_t *rt, uint16_t len) {
+  uint16_t id = conf.ctrid >> 16;
+  uint16_t n, i, off, sl;
+  uint8_t *e = rt + 3;
+  if (len < 3) return;
+  n = rt[2];
+  if (len < 3 + 6*n) return;
+  for (i=0; i<n; i++, e += 6) {
+    if ((e[0] | (e[1] << 8)) != id) continue;
+    off = e[2] | (e[3] << 8);
+    sl = e[4] | (e[5] << 8);
+    if (off >= len || sl > len - off) continue;
+    handleBinary(rt + off, sl);
   }
 }
 
@@ -451,9 +769,12 @@ void handleBinary(uint8_t *rt, uint16_t len) {
 // the pbuf is returned in the callback
 void handleUDP(pbuf *pb) {
   uint8_t * recPkt = (uint8_t*)(pb->payload);
+  clk_rx = micros64();
   switch (recPkt[0]) {
       case 'c': handleCommand(recPkt+1, pb->len-1); break;
       case 's': handleSync(recPkt+1, pb->len-1); break;
+      case 't': handleClock(recPkt+1, pb->len-1); break;
+      case 'm': handleSlices(recPkt, pb->len); break;
       case 'a': break; // ignore, alive packets are meant for the server
       default: handleBinary(recPkt, pb->len);
   }
@@ -466,21 +787,15 @@ void handleUDP(pbuf *pb) {
 // to the last program, and send out broadcast packets with our ID.
 void handleIP() {
   server.handleClient();
+  // a failed join is retried every 5 seconds
+  if (!mcast_joined && (uint16_t)(now - mcast_tim) > 5000) mcast_join();
   d = now - alive_tim;
   if (d > 1000 && wifimode == WIFI_LEAD) {
     share_config();  // send out config and timestamp every second
     alive_tim = now;
   }
   else if (d > 2000 && wifimode<WIFI_FOLLOW) {
-    // the "alive" packet is broadcasted to port +1 and shares the controller ID,
-    // the server then can collect controller IDs and corresponding IP addresses
-    pbuf* alivePkt = pbuf_alloc(PBUF_TRANSPORT, ALIVE_PKT_LEN, PBUF_RAM);
-    uint8_t * pktptr = (uint8_t*)(alivePkt->payload);
-    uint16_t wlen = snprintf((char*)pktptr, ALIVE_PKT_LEN, "a%08x", conf.ctrid);
-    alivePkt->len = wlen;
-    alivePkt->tot_len = wlen;
-    udp_endpoint.writeTo(alivePkt, act_bcast, UDP_PORT+1);
-    pbuf_free(alivePkt);
+    sendAlive();
     alive_tim = now;
     if (type == 255) {
       inacnt++;
@@ -495,6 +810,11 @@ void handleIP() {
       }
     }
   }
+  // while streaming, report the receive statistics every second
+  if (type == 255 && wifimode<WIFI_FOLLOW && (uint16_t)(now - stat_tim) > 1000) {
+    sendAlive();
+    stat_tim = now;
+  }
 }
 
 // ######################################################################
@@ -536,7 +856,6 @@ void strip_config(void) {
 void setup() {
   alive_tim = 0;
   inacnt = 0;
-  memset(tsa, 0, sizeof(tsa));
 
   pinMode(D8, OUTPUT);
   pinMode(D1, OUTPUT);
@@ -602,7 +921,6 @@ void setup() {
   attachInterrupt (D5, re_read, CHANGE);
   attachInterrupt (D6, re_read, CHANGE);
   base = millis();
-  ts_rec = base & 0x0000ffff;
 }
 
 void paramcol() {
@@ -693,7 +1011,6 @@ void proginit(uint8_t load)
 // - handle UI and time steps
 
 void loop() {
-  ts_hist = now;
   now = millis();
   // rotary encoder button: switch between parameters type specific
   // bit shift and add over some time to debounce
@@ -724,7 +1041,13 @@ void loop() {
     re_click = 0;
   }
   // check TCP; UDP are processed when arrived
-  if (WiFi.status() == WL_CONNECTED || wifimode==WIFI_LEAD) handleIP();
+  if (WiFi.status() == WL_CONNECTED || wifimode==WIFI_LEAD) {
+    // (re)connected, also after a roam to another access point
+    if (!wifi_up) mcast_join();
+    wifi_up = 1;
+    handleIP();
+  }
+  else wifi_up = 0;
   // disable interrupt while we check rotary encoder values
   noInterrupts();
   if (re_flag || wifi_param) {
@@ -759,7 +1082,8 @@ void loop() {
     proginit(1);
   }
 // #### LED strip calculations except when type = 255, udp to pixel ####
-  if (type != 255) {
+  if (type == 255) showDue();
+  else {
     // finally we actually run our effect programs:
     d = 1;
     switch (type) {
@@ -902,11 +1226,18 @@ void Stars_Load(void)
   dens = conf.density;
 }
 
+// slowly walk the color wheel on the synchronized clock, 135 seconds
+// the round, so all nodes are at the same hue
+uint16_t Stars_Hue(void)
+{
+  return (uint64_t)syncMs() * 497 >> 10;
+}
+
 void Stars_Init(void)
 {
   uint16_t i, cnt = led_cnt*64/100;
 
-  sparks.hue = 0; // walking the circle
+  sparks.hue = Stars_Hue();
   dcnt = led_cnt * ((dens+1) << 2) / 100;
   // cnt is the maximal density, dcnt can be lower
   for (i=0; i<cnt; i++)
@@ -929,10 +1260,8 @@ void Stars(void)
   uint16_t i;
   uint8_t init = 0;
 
+  sparks.hue = Stars_Hue();
   // parameter update
-  if (wifi_param & 0x040) {
-    sparks.hue = sparks_hue; // color wheel walk, just take over value from leading node
-  }
   if (re_param == 0x11 || wifi_param & 0x004) { // color wheel
     if (col > 17) col = 17;
     Stars_DispCol(col);
@@ -967,7 +1296,6 @@ void Stars(void)
     //hsv = strip.gamma32(hsv);
     strip.setPixelColor(p, hsv);
   }
-  sparks.hue += 16; // slowly walk the color wheel, 136 seconds the round
 }
 
 uint16_t getNewPos()
@@ -1169,8 +1497,8 @@ void Duco_Select(uint8_t i) {
     colors.ts = colors_ts;
     colors.off = colors_off;
   } else {
-    colors.gts = now;
-    colors.ts = now;
+    colors.gts = syncMs();
+    colors.ts = colors.gts;
     colors.off = 0;   
   }
 }
@@ -1187,15 +1515,15 @@ void Duco_Init()
 {
   Duco_Load();
   colors.del = Duco_Delay();
-  colors.ts = now - colors.del; // when the next shift is due
-  colors.gts = now;
+  colors.gts = syncMs();
+  colors.ts = colors.gts - colors.del; // when the next shift is due
   colors.off = 0;
   Duco_Select(col);
 }
 
 void Duco()
 {
-  uint16_t v=0, i, c = colors.off, tnow = now + ts_diff;
+  uint16_t v=0, i, c = colors.off, tnow = syncMs();
   // update parameters
   if (re_param == 0x11 || wifi_param & 0x004) { // color selection
     if (col > DUCO_MAX) col = DUCO_MAX;